@@ -0,0 +1,290 @@
+// Offline renderer for the BeepMidi synth core
+//
+//  Usage: beeprender [-r] [-s] [-b bps] [-f rate] [-t seconds] input output.wav
+//
+//  Input:  Standard MIDI File, or a raw serial byte stream with -r
+//  Output: 8bit mono WAV holding the PWM duty of every output tick
+//
+// The main loop and SysTick_Handler of the firmware are replayed here, as
+// built with IDLE_SLEEP and ISR_PROFILE:
+//  - every byte arrives at the time the serial link would deliver it, and
+//    output ticks fall every outputSamplePeriod cycles of HCLK
+//  - received bytes are parsed only when the firmware would wake to parse
+//    them: on USART1 IDLE one frame after a burst, when DMA has filled half
+//    of the receive ring, and when a telemetry report is due
+//  - F0 7D 02 nn F7 changes the output rate when it is parsed, and
+//    F0 7D 01 nn F7 the bit rate of the bytes after it, as the sender
+//    switches once the F7 is out
+//  - the governor runs where the main loop runs it
+// The main loop itself takes no time here, and neither does the boot
+// before the first tick, and rendering costs no cycles, so the governor
+// never sheds a voice. On the chip a note can reach the oscillators a few
+// ticks later than here, after the main loop has parsed its burst, so the
+// WAV is not meant to match the chip byte for byte; rv32sim -w runs the
+// real image for that.
+// After an output rate change the WAV header still gives the rate -f set.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "BeepSynth.h"
+#include "MidiParser.h"
+#include "SerialControl.h"
+#include "Telemetry.h"
+#include "MidiStream.h"
+#include "WavFile.h"
+
+#define TAIL_SECONDS      1.0
+
+// Stream times are in units of 1/(HCLK*bps) second, bps being the rate
+// the input starts at, so one cycle is bps units.
+static MidiStream stream;
+static uint32_t bps;
+static WavFile wav;
+static uint16_t psg_master_volume;
+static MidiParser parser;
+
+// When the next output tick is due
+static uint64_t tickTime;
+// Bytes DMA has written into the receive ring, and when USART1 sets IDLE,
+// 0 while it is not going to
+static size_t received;
+static uint64_t idleAt;
+// The firmware's wake reasons: rxEvent, and the rendering interrupts
+// ProfilerPending counts since the last report
+static uint8_t rxEvent;
+static uint32_t telemetryTicks;
+static uint8_t telemetryRequested;
+
+// Same work as SysTick_Handler
+static void RenderTick(void)
+{
+    WavWrite(&wav, psg_master_volume);
+    psg_master_volume = BeepSynthGetData();
+    BeepSynthRenderCycles(0, 1);
+    tickTime += (uint64_t)outputSamplePeriod * bps;
+    ++ telemetryTicks;
+}
+
+// HCLK of the CH32V003, for the governor's budget and the tick period
+uint32_t SystemCoreClock = 48000000;
+
+// The firmware main loop sleeps until the next tick empties the queue;
+// bytes keep arriving meanwhile
+static void ReceiveUntil(uint64_t time);
+void BeepSynthWait(void)
+{
+    ReceiveUntil(tickTime);
+    RenderTick();
+}
+
+// Deliver the next byte, or IDLE, whichever comes first, as DMA1_Channel5
+// and USART1_IRQHandler would
+static void ReceiveNext(void)
+{
+    uint64_t arrival = received < stream.count ? stream.time[received] : UINT64_MAX;
+    if(idleAt != 0 && idleAt < arrival)
+    {
+        idleAt = 0;
+        rxEvent = 1;
+        return;
+    }
+    // One quiet frame after the last stop bit sets IDLE
+    idleAt = arrival + stream.unitsPerByte;
+    ++ received;
+    if(received % (RX_BUFFER_LENGTH / 2) == 0)
+    {
+        rxEvent = 1;
+    }
+}
+
+static uint64_t NextReceive(void)
+{
+    uint64_t arrival = received < stream.count ? stream.time[received] : UINT64_MAX;
+    return idleAt != 0 && idleAt < arrival ? idleAt : arrival;
+}
+
+// Every byte and IDLE up to the given time, before the tick due then
+static void ReceiveUntil(uint64_t time)
+{
+    while(NextReceive() <= time)
+    {
+        ReceiveNext();
+    }
+}
+
+// Same as ReceiveSysEx in the firmware, for the output rate. The bit rate
+// was applied to the stream when it was loaded.
+static SerialControl serialControl;
+static void ReceiveSysEx(uint8_t event, uint8_t data)
+{
+    uint32_t rate;
+
+    BeepSynthSysEx(event, data);
+    if(SerialControlSysEx(&serialControl, event, data, &rate) == SYSEX_SAMPLING_FREQUENCY)
+    {
+        BeepSynthSetSamplingFrequency(rate);
+    }
+}
+
+// The sender switches its bit rate once the F7 of each F0 7D 01 nn F7 is
+// out. It reads its own stream as the firmware will, with a parser of its
+// own, so SysEx cut short or with real-time bytes inside counts the same.
+static SerialControl senderControl;
+static size_t senderPosition;
+static void SenderSysEx(uint8_t event, uint8_t data)
+{
+    uint32_t rate;
+
+    if(SerialControlSysEx(&senderControl, event, data, &rate) == SYSEX_SERIAL_RATE)
+    {
+        MidiStreamSetUnitsPerByte(&stream, senderPosition, ((uint64_t)SERIAL_BITS * SystemCoreClock * bps + rate / 2) / rate);
+    }
+}
+
+static void ApplySerialRates(void)
+{
+    MidiParser sender;
+    MidiParserInitialize(&sender, SenderSysEx);
+    SerialControlInitialize(&senderControl);
+    senderPosition = 0;
+    while(senderPosition < stream.count)
+    {
+        MidiParserPush(&sender, stream.data[senderPosition ++]);
+    }
+}
+
+// One pass of the firmware main loop: ReceiveMidi, BeepSynthGovern and
+// ProfilerPoll, again while bytes came in during a full voice queue
+static void MainLoop(void)
+{
+    do
+    {
+        size_t written = received;
+        rxEvent = 0;
+        while(stream.position < written)
+        {
+            if(!MidiParserPush(&parser, stream.data[stream.position ++]))
+            {
+                continue;
+            }
+            if(parser.message[0] == TELEMETRY_REQUEST)
+            {
+                telemetryRequested = 1;
+            }
+            BeepSynthMessage(parser.message[0], parser.message[1], parser.message[2]);
+        }
+        BeepSynthGovern();
+        if(telemetryRequested || telemetryTicks >= outputSamplingFrequency)
+        {
+            telemetryRequested = 0;
+            telemetryTicks = 0;
+        }
+    }
+    while(rxEvent);
+}
+
+// IdleWait: whether the main loop leaves WFI after a rendering interrupt
+static int MainLoopWakes(void)
+{
+    return telemetryRequested || telemetryTicks >= outputSamplingFrequency || BeepSynthGovernPending();
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: beeprender [-r] [-s] [-b bps] [-f rate] [-t seconds] input output.wav\n"
+                    "  -r          input is a raw serial byte stream\n"
+                    "  -s          send MIDI file events with running status\n"
+                    "  -b bps      serial bit rate (default %d)\n"
+                    "  -f rate     output sampling frequency, %d to %d (default %d)\n"
+                    "  -t seconds  silence rendered after the last byte (default %.1f)\n",
+                    SERIAL_BPS, SAMPLING_FREQUENCY_MIN, SAMPLING_FREQUENCY_MAX,
+                    OUTPUT_SAMPLING_FREQUENCY, TAIL_SECONDS);
+}
+
+int main(int argc, char* argv[])
+{
+    int raw = 0;
+    int runningStatus = 0;
+    double tail = TAIL_SECONDS;
+    uint32_t rate = OUTPUT_SAMPLING_FREQUENCY;
+    uint64_t end;
+    int option;
+
+    bps = SERIAL_BPS;
+    while((option = getopt(argc, argv, "rsb:f:t:")) != -1)
+    {
+        switch(option)
+        {
+        case 'r':
+            raw = 1;
+            break;
+        case 's':
+            runningStatus = 1;
+            break;
+        case 'b':
+            bps = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            rate = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            tail = atof(optarg);
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+    if(argc - optind != 2 || bps == 0 || tail < 0.0
+       || rate < SAMPLING_FREQUENCY_MIN || rate > SAMPLING_FREQUENCY_MAX)
+    {
+        Usage();
+        return 1;
+    }
+
+    MidiStreamInitialize(&stream, (uint64_t)SystemCoreClock * bps, (uint64_t)SERIAL_BITS * SystemCoreClock);
+    stream.runningStatus = runningStatus;
+    if(!MidiStreamLoadFile(&stream, argv[optind], raw))
+    {
+        return 1;
+    }
+    ApplySerialRates();
+
+    if(!WavOpen(&wav, argv[optind + 1], rate))
+    {
+        return 1;
+    }
+
+    // As main: synth first, then SetupSysTick schedules the first tick one
+    // period after the counter starts
+    psg_master_volume = 0;
+    BeepSynthInitialize();
+    BeepSynthSetSamplingFrequency(rate);
+    tickTime = (uint64_t)outputSamplePeriod * bps;
+    SerialControlInitialize(&serialControl);
+    MidiParserInitialize(&parser, ReceiveSysEx);
+    end = stream.lastArrival + (uint64_t)(tail * stream.unitsPerSecond);
+    while(received < stream.count || idleAt != 0 || tickTime < end)
+    {
+        // A byte or IDLE at the same time as a tick comes first
+        if(tickTime < NextReceive())
+        {
+            RenderTick();
+            if(MainLoopWakes())
+            {
+                MainLoop();
+            }
+            continue;
+        }
+        ReceiveNext();
+        if(rxEvent)
+        {
+            MainLoop();
+        }
+    }
+
+    WavClose(&wav);
+    MidiStreamFree(&stream);
+    return 0;
+}
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MidiStream.h"
+
+// SMF event
+typedef struct SmfEvent_
+{
+    uint32_t tick;
+    uint32_t order;
+    uint32_t tempo;
+    uint8_t length;
+    uint8_t data[3];
+} SmfEvent;
+
+void MidiStreamInitialize(MidiStream* stream, uint64_t unitsPerSecond, uint64_t unitsPerByte)
+{
+    memset(stream, 0, sizeof(MidiStream));
+    stream->unitsPerSecond = unitsPerSecond;
+    stream->unitsPerByte = unitsPerByte;
+}
+
+void MidiStreamFree(MidiStream* stream)
+{
+    free(stream->data);
+    free(stream->time);
+    free(stream->earliest);
+    stream->data = NULL;
+    stream->time = NULL;
+    stream->earliest = NULL;
+    stream->count = stream->capacity = stream->position = 0;
+}
+
+// Queue one byte. It is on the wire no earlier than the given time and
+// never before the previous byte has been received.
+void MidiStreamPush(MidiStream* stream, uint8_t data, uint64_t earliest)
+{
+    uint64_t arrival;
+    if(stream->count == stream->capacity)
+    {
+        stream->capacity = stream->capacity ? stream->capacity * 2 : 4096;
+        stream->data = realloc(stream->data, stream->capacity);
+        stream->time = realloc(stream->time, stream->capacity * sizeof(uint64_t));
+        stream->earliest = realloc(stream->earliest, stream->capacity * sizeof(uint64_t));
+        if(stream->data == NULL || stream->time == NULL || stream->earliest == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    arrival = earliest > stream->lastArrival ? earliest : stream->lastArrival;
+    arrival += stream->unitsPerByte;
+    stream->data[stream->count] = data;
+    stream->time[stream->count] = arrival;
+    stream->earliest[stream->count] = earliest;
+    stream->lastArrival = arrival;
+    ++ stream->count;
+}
+
+// The sender changes its bit rate: the bytes from index from on take
+// unitsPerByte each and arrive again as late as that makes them
+void MidiStreamSetUnitsPerByte(MidiStream* stream, size_t from, uint64_t unitsPerByte)
+{
+    uint64_t arrival = from > 0 ? stream->time[from - 1] : 0;
+    stream->unitsPerByte = unitsPerByte;
+    for(size_t i = from; i < stream->count; i ++)
+    {
+        arrival = stream->earliest[i] > arrival ? stream->earliest[i] : arrival;
+        arrival += unitsPerByte;
+        stream->time[i] = arrival;
+    }
+    if(stream->count > 0)
+    {
+        stream->lastArrival = stream->time[stream->count - 1];
+    }
+}
+
+static uint32_t ReadBE(const uint8_t* p, int length)
+{
+    uint32_t value = 0;
+    for(int i = 0; i < length; i ++)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static int ReadVLQ(const uint8_t** p, const uint8_t* end, uint32_t* value)
+{
+    *value = 0;
+    for(int i = 0; i < 4; i ++)
+    {
+        if(*p >= end)
+        {
+            return 0;
+        }
+        uint8_t data = *(*p) ++;
+        *value = (*value << 7) | (data & 0x7F);
+        if((data & 0x80) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int CompareSmfEvent(const void* a, const void* b)
+{
+    const SmfEvent* ea = a;
+    const SmfEvent* eb = b;
+    if(ea->tick != eb->tick)
+    {
+        return ea->tick < eb->tick ? -1 : 1;
+    }
+    return ea->order < eb->order ? -1 : (ea->order > eb->order);
+}
+
+// Decode all tracks of a Standard MIDI File into the byte stream.
+// Channel messages are sent with a full status byte each, or with running
+// status when stream->runningStatus is set; meta and SysEx events are
+// dropped.
+int MidiStreamLoadSmf(MidiStream* stream, const uint8_t* file, size_t size)
+{
+    SmfEvent* events = NULL;
+    size_t eventCount = 0, eventCapacity = 0;
+    const uint8_t* p = file;
+    const uint8_t* end = file + size;
+    uint16_t trackCount, division;
+    uint32_t headerLength;
+
+    if(size < 14 || memcmp(p, "MThd", 4) != 0)
+    {
+        return 0;
+    }
+    headerLength = ReadBE(p + 4, 4);
+    if(headerLength < 6 || headerLength > size - 8)
+    {
+        return 0;
+    }
+    trackCount = ReadBE(p + 10, 2);
+    division = ReadBE(p + 12, 2);
+    // Ticks per quarter note, or SMPTE ticks per frame, are divisors below
+    if(division == 0 || ((division & 0x8000) && (division & 0xFF) == 0))
+    {
+        return 0;
+    }
+    p += 8 + headerLength;
+
+    for(int track = 0; track < trackCount && p + 8 <= end; track ++)
+    {
+        uint32_t length = ReadBE(p + 4, 4);
+        const uint8_t* q = p + 8;
+        // A track running past the end of the file is cut at it
+        const uint8_t* trackEnd = length < (size_t)(end - q) ? q + length : end;
+        uint32_t tick = 0;
+        uint8_t status = 0;
+        if(memcmp(p, "MTrk", 4) != 0)
+        {
+            p = trackEnd;
+            continue;
+        }
+        while(q < trackEnd)
+        {
+            uint32_t delta, skip;
+            SmfEvent event = {0};
+            if(!ReadVLQ(&q, trackEnd, &delta))
+            {
+                break;
+            }
+            tick += delta;
+            if(q >= trackEnd)
+            {
+                break;
+            }
+            if(*q >= 0x80)
+            {
+                status = *q ++;
+            }
+            if(status == 0xFF)
+            {
+                // Meta event, keep Set Tempo only
+                if(q >= trackEnd)
+                {
+                    break;
+                }
+                uint8_t type = *q ++;
+                if(!ReadVLQ(&q, trackEnd, &skip) || skip > (size_t)(trackEnd - q))
+                {
+                    break;
+                }
+                if(type == 0x51 && skip == 3)
+                {
+                    event.tempo = ReadBE(q, 3);
+                }
+                q += skip;
+                status = 0;
+                if(event.tempo == 0)
+                {
+                    continue;
+                }
+            }
+            else if(status == 0xF0 || status == 0xF7)
+            {
+                if(!ReadVLQ(&q, trackEnd, &skip) || skip > (size_t)(trackEnd - q))
+                {
+                    break;
+                }
+                q += skip;
+                status = 0;
+                continue;
+            }
+            else if(status >= 0x80)
+            {
+                int dataLength = ((status & 0xE0) == 0xC0) ? 1 : 2;
+                if(dataLength > trackEnd - q)
+                {
+                    break;
+                }
+                event.data[0] = status;
+                event.data[1] = q[0];
+                event.data[2] = dataLength == 2 ? q[1] : 0;
+                event.length = 1 + dataLength;
+                q += dataLength;
+            }
+            else
+            {
+                // Data byte without running status
+                ++ q;
+                continue;
+            }
+            if(eventCount == eventCapacity)
+            {
+                eventCapacity = eventCapacity ? eventCapacity * 2 : 1024;
+                events = realloc(events, eventCapacity * sizeof(SmfEvent));
+                if(events == NULL)
+                {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+            }
+            event.tick = tick;
+            event.order = (uint32_t)eventCount;
+            events[eventCount ++] = event;
+        }
+        p = trackEnd;
+    }
+
+    if(eventCount > 0)
+    {
+        qsort(events, eventCount, sizeof(SmfEvent), CompareSmfEvent);
+    }
+
+    // Tick to time, following the tempo map
+    double seconds = 0.0;
+    double secondsPerTick;
+    uint32_t lastTick = 0;
+    uint8_t lastStatus = 0;
+    if(division & 0x8000)
+    {
+        int fps = 256 - (division >> 8);
+        secondsPerTick = 1.0 / (fps * (division & 0xFF));
+    }
+    else
+    {
+        secondsPerTick = 0.5 / division;
+    }
+    for(size_t i = 0; i < eventCount; i ++)
+    {
+        seconds += (events[i].tick - lastTick) * secondsPerTick;
+        lastTick = events[i].tick;
+        if(events[i].tempo != 0)
+        {
+            if((division & 0x8000) == 0)
+            {
+                secondsPerTick = events[i].tempo / 1000000.0 / division;
+            }
+            continue;
+        }
+        uint64_t time = (uint64_t)(seconds * stream->unitsPerSecond + 0.5);
+        for(int j = 0; j < events[i].length; j ++)
+        {
+            if(j == 0 && stream->runningStatus && events[i].data[0] == lastStatus)
+            {
+                continue;
+            }
+            MidiStreamPush(stream, events[i].data[j], time);
+        }
+        lastStatus = events[i].data[0];
+    }
+    free(events);
+    return 1;
+}
+
+// Load a Standard MIDI File, or any file as raw serial bytes sent back to back
+int MidiStreamLoadFile(MidiStream* stream, const char* path, int raw)
+{
+    FILE* input;
+    uint8_t* file;
+    long size;
+    int result = 1;
+
+    input = fopen(path, "rb");
+    if(input == NULL)
+    {
+        perror(path);
+        return 0;
+    }
+    // The size comes from seeking, so a pipe is refused
+    if(fseek(input, 0, SEEK_END) != 0 || (size = ftell(input)) < 0 || fseek(input, 0, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "cannot seek in %s\n", path);
+        fclose(input);
+        return 0;
+    }
+    file = malloc(size > 0 ? size : 1);
+    if(file == NULL || fread(file, 1, size, input) != (size_t)size)
+    {
+        fprintf(stderr, "cannot read %s\n", path);
+        fclose(input);
+        free(file);
+        return 0;
+    }
+    fclose(input);
+
+    if(raw)
+    {
+        for(long i = 0; i < size; i ++)
+        {
+            MidiStreamPush(stream, file[i], 0);
+        }
+    }
+    else if(!MidiStreamLoadSmf(stream, file, size))
+    {
+        fprintf(stderr, "%s is not a Standard MIDI File (use -r for raw bytes)\n", path);
+        result = 0;
+    }
+    free(file);
+    return result;
+}
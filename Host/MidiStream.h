@@ -0,0 +1,34 @@
+#ifndef MIDISTREAM_H
+#define MIDISTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SERIAL_BPS        38400
+#define SERIAL_BITS       10
+
+// Serial byte stream with the time each byte is fully received.
+// Times use an arbitrary unit chosen by the caller: unitsPerSecond for one
+// second and unitsPerByte for one byte on the wire.
+typedef struct MidiStream_
+{
+    uint8_t* data;
+    uint64_t* time;
+    uint64_t* earliest;     // when the sender had each byte ready
+    size_t count;
+    size_t capacity;
+    size_t position;
+    uint64_t lastArrival;
+    uint64_t unitsPerSecond;
+    uint64_t unitsPerByte;
+    int runningStatus;      // omit repeated status bytes, as MIDI senders do
+} MidiStream;
+
+void MidiStreamInitialize(MidiStream* stream, uint64_t unitsPerSecond, uint64_t unitsPerByte);
+void MidiStreamFree(MidiStream* stream);
+void MidiStreamPush(MidiStream* stream, uint8_t data, uint64_t earliest);
+void MidiStreamSetUnitsPerByte(MidiStream* stream, size_t from, uint64_t unitsPerByte);
+int MidiStreamLoadSmf(MidiStream* stream, const uint8_t* file, size_t size);
+int MidiStreamLoadFile(MidiStream* stream, const char* path, int raw);
+
+#endif
@@ -0,0 +1,108 @@
+// Dense note stream for benchmarking the MIDI input path
+//
+//  Usage: noteflood [-s] [-n events] output
+//
+//  Output: raw serial bytes for rv32sim -r or beeprender -r
+//
+// Note on and note off alternate, keeping FLOOD_HELD notes sounding, so
+// every event reaches the parser and the voice allocator. Sent back to back
+// the stream runs at the full wire rate.
+//  - default: channels 0-7, note off as 8n, 3 bytes per event
+//  - -s: channel 0 with running status and note on velocity 0 as note off,
+//    2 bytes per event after the first
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define FLOOD_EVENTS      10000
+#define FLOOD_HELD        8
+#define FLOOD_CHANNELS    8
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: noteflood [-s] [-n events] output\n"
+                    "  -s          one channel with running status\n"
+                    "  -n events   note on and off events (default %d)\n",
+                    FLOOD_EVENTS);
+}
+
+int main(int argc, char* argv[])
+{
+    int runningStatus = 0;
+    long events = FLOOD_EVENTS;
+    int held[FLOOD_HELD];
+    int heldCount = 0;
+    int oldest = 0;
+    int lastStatus = -1;
+    int option;
+    FILE* file;
+
+    while((option = getopt(argc, argv, "sn:")) != -1)
+    {
+        switch(option)
+        {
+        case 's':
+            runningStatus = 1;
+            break;
+        case 'n':
+            events = strtol(optarg, NULL, 0);
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+    if(argc - optind != 1 || events <= 0)
+    {
+        Usage();
+        return 1;
+    }
+    file = fopen(argv[optind], "wb");
+    if(file == NULL)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    for(long i = 0; i < events; i ++)
+    {
+        int key, status, velocity;
+        // Fill up, then alternate off and on
+        if(heldCount < FLOOD_HELD)
+        {
+            // Spread over four octaves and the channels
+            key = 36 + (int)((i * 7) % 48);
+            if(!runningStatus)
+            {
+                key |= (int)((i / 2) % FLOOD_CHANNELS) << 8;
+            }
+            held[(oldest + heldCount) % FLOOD_HELD] = key;
+            ++ heldCount;
+            status = 0x90 | (key >> 8);
+            velocity = 100;
+        }
+        else
+        {
+            key = held[oldest];
+            oldest = (oldest + 1) % FLOOD_HELD;
+            -- heldCount;
+            status = runningStatus ? 0x90 : 0x80 | (key >> 8);
+            velocity = runningStatus ? 0 : 64;
+        }
+        if(status != lastStatus || !runningStatus)
+        {
+            fputc(status, file);
+            lastStatus = status;
+        }
+        fputc(key & 0x7F, file);
+        fputc(velocity, file);
+    }
+
+    if(fclose(file) != 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    return 0;
+}
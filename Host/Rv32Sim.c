@@ -0,0 +1,1579 @@
+// RV32EC instruction set simulator for the BeepMidi firmware
+//
+//  Usage: rv32sim [-r] [-s] [-b bps] [-t seconds] [-w out.wav] [-u tx.bin] firmware.elf input
+//
+// Runs the real firmware image, as built from this tree, from reset on a model of
+// the parts of the CH32V003 it touches: SysTick, PFIC, RCC, TIM1, USART1,
+// TIM2 and DMA1 (USART1 RX on channel 5, TX on channel 4, TIM2_UP on
+// channel 2). MIDI bytes from a Standard MIDI File or a raw capture are
+// clocked into USART1 RX at the serial bit rate, and the cycles spent in
+// every interrupt handler invocation are reported. Bytes sent on USART1
+// TX, such as telemetry frames for teledump, can be captured with -u.
+// Cycles the firmware spends sleeping in WFI are reported as well.
+
+// Cycle model of the QingKe V2A core at HCLK 48MHz, FLASH latency 1.
+// The numbers below are the model, not a measurement; retune them if a
+// scope on a GPIO toggle disagrees.
+//  - ALU, CSR, not taken branch: 1 cycle
+//  - load 2, store 1, jal 2, jalr and taken branch 3
+//  - each new 32bit word fetched from flash, and each load from flash,
+//    adds FLASH_WAIT_STATES
+//  - interrupt entry with HPE stacking and vector fetch, and mret
+//  - WCH XW compressed byte/halfword loads and stores are decoded; every
+//    one in obj/BeepMidi.lst, the vendor toolchain's own disassembly,
+//    decodes to the same registers and offset here
+//  - interrupt nesting follows the PFIC preemption bit (IPRIOR bit7)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "MidiStream.h"
+#include "WavFile.h"
+
+#define HCLK                  48000000
+#define TAIL_SECONDS          1.0
+// Output rate until the firmware has set RATE_SYMBOL. An image without the
+// symbol, such as the committed obj/BeepMidi.elf, predates this tree and
+// is refused.
+#define WAV_RATE              16000
+#define RATE_SYMBOL           "outputSamplingFrequency"
+
+#define FLASH_BASE            0x00000000
+#define FLASH_ALIAS_BASE      0x08000000
+#define FLASH_SIZE            (16 * 1024)
+#define RAM_BASE              0x20000000
+#define RAM_SIZE              (2 * 1024)
+#define PERIPH_BASE           0x40000000
+#define PERIPH_SIZE           0x24000
+#define PFIC_BASE             0xE000E000
+#define PFIC_SIZE             0x1000
+#define SYSTICK_BASE          0xE000F000
+
+#define TIM2_BASE             0x40000000
+#define TIM1_BASE             0x40012C00
+#define USART1_BASE           0x40013800
+#define DMA1_BASE             0x40020000
+#define RCC_BASE              0x40021000
+
+#define CYCLES_ALU            1
+#define CYCLES_LOAD           2
+#define CYCLES_STORE          1
+#define CYCLES_JUMP           2
+#define CYCLES_JUMP_REGISTER  3
+#define CYCLES_BRANCH_TAKEN   3
+#define CYCLES_IRQ_ENTRY      8
+#define CYCLES_MRET           4
+#define FLASH_WAIT_STATES     1
+
+#define IRQ_COUNT             39
+#define IRQ_SYSTICK           12
+#define IRQ_SOFTWARE          14
+#define IRQ_DMA1_CHANNEL1     22
+#define IRQ_USART1            32
+#define IRQ_TIM2              38
+#define DMA_CHANNEL_COUNT     7
+#define NEST_LEVELS           2
+
+#define CSR_MSTATUS           0x300
+#define CSR_MTVEC             0x305
+#define CSR_MEPC              0x341
+#define CSR_MCAUSE            0x342
+#define CSR_INTSYSCR          0x804
+
+// Per handler statistics
+typedef struct IrqStat_
+{
+    uint64_t count;
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+} IrqStat;
+
+// One level of interrupt nesting
+typedef struct IrqFrame_
+{
+    int irq;
+    uint64_t start;
+    uint32_t mepc;
+    uint32_t mstatus;
+    uint32_t hpe[10];
+} IrqFrame;
+
+typedef struct DmaChannel_
+{
+    uint32_t cfgr;
+    uint32_t cntr;
+    uint32_t reload;
+    uint32_t paddr;
+    uint32_t maddr;
+} DmaChannel;
+
+static const char* irqNames[IRQ_COUNT] =
+{
+    [IRQ_SYSTICK] = "SysTick",
+    [IRQ_SOFTWARE] = "SW",
+    [22] = "DMA1_Channel1", [23] = "DMA1_Channel2", [24] = "DMA1_Channel3",
+    [25] = "DMA1_Channel4", [26] = "DMA1_Channel5", [27] = "DMA1_Channel6",
+    [28] = "DMA1_Channel7", [IRQ_USART1] = "USART1", [35] = "TIM1_UP",
+    [38] = "TIM2",
+};
+
+// Core
+static uint32_t x[16];
+static uint32_t pc;
+static uint32_t csr[4096];
+static uint64_t cycles;
+static uint64_t sleepCycles;    // spent in WFI
+static uint32_t fetchWord;
+
+// Memory
+static uint8_t flash[FLASH_SIZE];
+static uint8_t ram[RAM_SIZE];
+static uint32_t periph[PERIPH_SIZE / 4];
+static uint32_t pfic[PFIC_SIZE / 4];
+
+// PFIC
+static uint32_t irqEnable[2];
+static uint32_t irqPending[2];
+static IrqFrame irqStack[NEST_LEVELS];
+static int irqDepth;
+static IrqStat irqStat[IRQ_COUNT];
+
+// SysTick
+static uint32_t systickCtlr, systickSr, systickCnt, systickCmp;
+static uint32_t systickPrescale;
+
+// USART1 / DMA1
+static DmaChannel dma[DMA_CHANNEL_COUNT];
+static uint32_t dmaFlags;
+static uint32_t usartStatr;
+static uint8_t usartRxData;
+static uint64_t usartIdleAt;    // stream time IDLE sets, 0 when not armed
+static uint64_t usartTxBusyUntil;
+static FILE* txFile;
+
+// TIM1
+static uint32_t tim1Ch4cvr;
+
+// TIM2, counted from the cycle of its next update event (0 while stopped)
+static uint64_t tim2NextUpdate;
+
+// Input and output
+static MidiStream stream;
+static uint32_t bps;
+static WavFile wav;
+static const char* wavPath;
+static uint32_t rateAddress;    // of RATE_SYMBOL in RAM
+
+static void Fatal(const char* message, uint32_t value)
+{
+    fprintf(stderr, "rv32sim: %s 0x%08x at pc 0x%08x (cycle %llu)\n", message, value, pc, (unsigned long long)cycles);
+    exit(1);
+}
+
+// XW encodings whose offset bits no instruction in obj/BeepMidi.lst sets.
+// They decode by the pattern of the confirmed ones, so say once that a run
+// used one.
+static void Unconfirmed(uint32_t insn)
+{
+    static int warned;
+
+    if(!warned)
+    {
+        fprintf(stderr, "rv32sim: XW encoding 0x%04x at pc 0x%08x is not confirmed by a WCH listing\n", insn, pc);
+        warned = 1;
+    }
+}
+
+static int InFlash(uint32_t address)
+{
+    return address < FLASH_SIZE || (address >= FLASH_ALIAS_BASE && address < FLASH_ALIAS_BASE + FLASH_SIZE);
+}
+
+// ------------------------------------------------------------------
+// Peripherals
+// ------------------------------------------------------------------
+
+static void DmaUpdateFlags(int channel)
+{
+    // GIF follows TC|HT|TE of the channel
+    uint32_t shift = channel * 4;
+    if(dmaFlags & (0xE << shift))
+    {
+        dmaFlags |= 1 << shift;
+    }
+    else
+    {
+        dmaFlags &= ~(1 << shift);
+    }
+}
+
+// Memory side address of the next unit, as an offset into RAM
+static uint32_t DmaAddress(DmaChannel* ch, uint32_t size)
+{
+    uint32_t index = ch->reload - ch->cntr;
+    uint32_t address = ch->maddr + ((ch->cfgr & 0x80) ? index * size : 0) - RAM_BASE;
+    if(address + size > RAM_SIZE)
+    {
+        Fatal("DMA access outside RAM", ch->maddr);
+    }
+    return address;
+}
+
+static void DmaAdvance(int channel)
+{
+    DmaChannel* ch = &dma[channel];
+    -- ch->cntr;
+    if(ch->cntr == ch->reload / 2)
+    {
+        dmaFlags |= 4 << (channel * 4);
+    }
+    if(ch->cntr == 0)
+    {
+        dmaFlags |= 2 << (channel * 4);
+        if(ch->cfgr & 0x20)
+        {
+            ch->cntr = ch->reload;
+        }
+    }
+    DmaUpdateFlags(channel);
+}
+
+// Peripheral to memory transfer of one unit on a DMA request
+static int DmaRequest(int channel, uint32_t data)
+{
+    DmaChannel* ch = &dma[channel];
+    uint32_t size = 1 << ((ch->cfgr >> 10) & 3);
+
+    if((ch->cfgr & 1) == 0 || ch->cntr == 0)
+    {
+        return 0;
+    }
+    memcpy(&ram[DmaAddress(ch, size)], &data, size);
+    DmaAdvance(channel);
+    return 1;
+}
+
+// Memory to peripheral transfer of one unit on a DMA request
+static int DmaFetch(int channel, uint32_t* data)
+{
+    DmaChannel* ch = &dma[channel];
+    uint32_t size = 1 << ((ch->cfgr >> 10) & 3);
+
+    if((ch->cfgr & 0x11) != 0x11 || ch->cntr == 0)
+    {
+        return 0;
+    }
+    *data = 0;
+    memcpy(data, &ram[DmaAddress(ch, size)], size);
+    DmaAdvance(channel);
+    return 1;
+}
+
+static void UsartTransmit(uint8_t data)
+{
+    uint32_t brr = periph[(USART1_BASE + 0x08 - PERIPH_BASE) / 4];
+    if(txFile != NULL)
+    {
+        fputc(data, txFile);
+    }
+    usartTxBusyUntil = cycles + (brr ? (uint64_t)brr * SERIAL_BITS : 0);
+}
+
+static void UsartReceive(uint8_t data)
+{
+    uint32_t ctlr3 = periph[(USART1_BASE + 0x14 - PERIPH_BASE) / 4];
+    if((ctlr3 & 0x40) && DmaRequest(4, data))
+    {
+        return;
+    }
+    if(usartStatr & 0x20)
+    {
+        usartStatr |= 0x08;     // ORE
+    }
+    usartStatr |= 0x20;         // RXNE
+    usartRxData = data;
+}
+
+static void PeriphWrite(uint32_t address, uint32_t value);
+static void SampleWrite(void);
+
+// Cycles between TIM2 update events
+static uint64_t Tim2Period(void)
+{
+    uint32_t psc = periph[(TIM2_BASE + 0x28 - PERIPH_BASE) / 4] & 0xFFFF;
+    uint32_t arr = periph[(TIM2_BASE + 0x2C - PERIPH_BASE) / 4] & 0xFFFF;
+    return (uint64_t)(psc + 1) * (arr + 1);
+}
+
+// Update event: UIF, and one DMA1_Channel2 transfer when UDE is set
+static void Tim2Update(void)
+{
+    uint32_t dier = periph[(TIM2_BASE + 0x0C - PERIPH_BASE) / 4];
+    uint32_t data;
+
+    tim2NextUpdate += Tim2Period();
+    periph[(TIM2_BASE + 0x10 - PERIPH_BASE) / 4] |= 1;
+    if((dier & 0x100) && DmaFetch(1, &data))
+    {
+        PeriphWrite(dma[1].paddr, data);
+        if(wavPath != NULL)
+        {
+            SampleWrite();
+        }
+    }
+}
+
+static void SysTickCount(void)
+{
+    if(systickCnt == systickCmp && (systickCtlr & 8))
+    {
+        systickCnt = 0;
+    }
+    else
+    {
+        ++ systickCnt;
+    }
+    if(systickCnt == systickCmp)
+    {
+        systickSr |= 1;
+    }
+}
+
+// Advance the clock, with everything that runs on it
+static void Tick(uint32_t count)
+{
+    while(count --)
+    {
+        ++ cycles;
+        if(systickCtlr & 1)
+        {
+            if(systickCtlr & 4)
+            {
+                SysTickCount();
+            }
+            else if(++ systickPrescale == 8)
+            {
+                systickPrescale = 0;
+                SysTickCount();
+            }
+        }
+    }
+    while(stream.position < stream.count && stream.time[stream.position] <= cycles * bps)
+    {
+        // One quiet frame after the last stop bit sets IDLE
+        usartIdleAt = stream.time[stream.position] + stream.unitsPerByte;
+        UsartReceive(stream.data[stream.position ++]);
+    }
+    if(usartIdleAt != 0 && usartIdleAt <= cycles * bps)
+    {
+        usartIdleAt = 0;
+        usartStatr |= 0x10;     // IDLE
+    }
+    if(tim2NextUpdate != 0 && cycles >= tim2NextUpdate)
+    {
+        Tim2Update();
+    }
+    // USART1_TX on DMA1_Channel4 takes the next byte once TXE is set
+    if((dma[3].cfgr & 1) && cycles >= usartTxBusyUntil)
+    {
+        uint32_t ctlr3 = periph[(USART1_BASE + 0x14 - PERIPH_BASE) / 4];
+        uint32_t data;
+        if((ctlr3 & 0x80) && DmaFetch(3, &data))
+        {
+            UsartTransmit(data);
+        }
+    }
+}
+
+static uint32_t PeriphRead(uint32_t address)
+{
+    uint32_t offset = address - PERIPH_BASE;
+    uint32_t value = periph[offset / 4];
+
+    if(address >= DMA1_BASE + 0x08 && address < DMA1_BASE + 0x08 + DMA_CHANNEL_COUNT * 0x14)
+    {
+        DmaChannel* ch = &dma[(address - DMA1_BASE - 0x08) / 0x14];
+        switch((address - DMA1_BASE - 0x08) % 0x14)
+        {
+        case 0x00: return ch->cfgr;
+        case 0x04: return ch->cntr;
+        case 0x08: return ch->paddr;
+        case 0x0C: return ch->maddr;
+        }
+        return 0;
+    }
+    switch(address)
+    {
+    case RCC_BASE + 0x00:
+        // HSIRDY, HSERDY and PLLRDY follow their enable bits at once
+        return value | ((value & 0x01010001) << 1);
+    case RCC_BASE + 0x04:
+        // SWS mirrors SW
+        return (value & ~0x0C) | ((value & 3) << 2);
+    case USART1_BASE + 0x00:
+        value = usartStatr;
+        if(cycles >= usartTxBusyUntil)
+        {
+            value |= 0xC0;      // TXE, TC
+        }
+        return value;
+    case USART1_BASE + 0x04:
+        usartStatr &= ~0x38;
+        return usartRxData;
+    case DMA1_BASE + 0x00:
+        return dmaFlags;
+    case TIM1_BASE + 0x40:
+        return tim1Ch4cvr;
+    case TIM2_BASE + 0x24:
+        if(tim2NextUpdate == 0)
+        {
+            return value;
+        }
+        return (uint32_t)((Tim2Period() - (tim2NextUpdate - cycles)) / ((periph[(TIM2_BASE + 0x28 - PERIPH_BASE) / 4] & 0xFFFF) + 1));
+    }
+    return value;
+}
+
+static void PeriphWrite(uint32_t address, uint32_t value)
+{
+    uint32_t offset = address - PERIPH_BASE;
+
+    if(address >= DMA1_BASE + 0x08 && address < DMA1_BASE + 0x08 + DMA_CHANNEL_COUNT * 0x14)
+    {
+        int channel = (address - DMA1_BASE - 0x08) / 0x14;
+        DmaChannel* ch = &dma[channel];
+        switch((address - DMA1_BASE - 0x08) % 0x14)
+        {
+        case 0x00: ch->cfgr = value & 0x7FFF; break;
+        case 0x04: ch->cntr = ch->reload = value & 0xFFFF; break;
+        case 0x08: ch->paddr = value; break;
+        case 0x0C: ch->maddr = value; break;
+        }
+        return;
+    }
+    switch(address)
+    {
+    case USART1_BASE + 0x04:
+        UsartTransmit(value & 0xFF);
+        return;
+    case DMA1_BASE + 0x04:
+        dmaFlags &= ~value;
+        for(int i = 0; i < DMA_CHANNEL_COUNT; i ++)
+        {
+            DmaUpdateFlags(i);
+        }
+        return;
+    case TIM1_BASE + 0x40:
+        tim1Ch4cvr = value & 0xFFFF;
+        return;
+    case TIM2_BASE + 0x00:
+        // CEN starts the counter from zero
+        if((value & 1) == 0)
+        {
+            tim2NextUpdate = 0;
+        }
+        else if(tim2NextUpdate == 0)
+        {
+            tim2NextUpdate = cycles + Tim2Period();
+        }
+        break;
+    case TIM2_BASE + 0x10:
+        // INTFR flags are cleared by writing 0
+        value &= periph[offset / 4];
+        break;
+    }
+    periph[offset / 4] = value;
+}
+
+static uint32_t SysTickRead(uint32_t address)
+{
+    switch(address - SYSTICK_BASE)
+    {
+    case 0x00: return systickCtlr;
+    case 0x04: return systickSr;
+    case 0x08: return systickCnt;
+    case 0x10: return systickCmp;
+    }
+    return 0;
+}
+
+static void SysTickWrite(uint32_t address, uint32_t value)
+{
+    switch(address - SYSTICK_BASE)
+    {
+    case 0x00:
+        systickCtlr = value;
+        if(value & 0x20)
+        {
+            systickCnt = 0;     // INIT
+            systickCtlr &= ~0x20;
+        }
+        break;
+    case 0x04: systickSr = value & 1; break;
+    case 0x08: systickCnt = value; break;
+    case 0x10: systickCmp = value; break;
+    }
+}
+
+static uint32_t PficRead(uint32_t address)
+{
+    uint32_t offset = address - PFIC_BASE;
+    if(offset >= 0x20 && offset < 0x28)
+    {
+        return irqPending[(offset - 0x20) / 4];
+    }
+    if(offset >= 0x100 && offset < 0x108)
+    {
+        return irqEnable[(offset - 0x100) / 4];
+    }
+    return pfic[offset / 4];
+}
+
+static void PficWrite(uint32_t address, uint32_t value, uint32_t mask)
+{
+    uint32_t offset = address - PFIC_BASE;
+    if(offset >= 0x100 && offset < 0x108)
+    {
+        irqEnable[(offset - 0x100) / 4] |= value;       // IENR
+    }
+    else if(offset >= 0x180 && offset < 0x188)
+    {
+        irqEnable[(offset - 0x180) / 4] &= ~value;      // IRER
+    }
+    else if(offset >= 0x200 && offset < 0x208)
+    {
+        irqPending[(offset - 0x200) / 4] |= value;      // IPSR
+    }
+    else if(offset >= 0x280 && offset < 0x288)
+    {
+        irqPending[(offset - 0x280) / 4] &= ~value;     // IPRR
+    }
+    else
+    {
+        pfic[offset / 4] = (pfic[offset / 4] & ~mask) | (value & mask);
+    }
+}
+
+// ------------------------------------------------------------------
+// Memory access
+// ------------------------------------------------------------------
+
+static uint32_t Load(uint32_t address, int size)
+{
+    uint32_t value = 0;
+    uint32_t word;
+    int shift = (address & 3) * 8;
+
+    if(InFlash(address))
+    {
+        uint32_t offset = address & (FLASH_SIZE - 1);
+        if(offset + size > FLASH_SIZE)
+        {
+            Fatal("load past end of flash", address);
+        }
+        memcpy(&value, &flash[offset], size);
+        Tick(FLASH_WAIT_STATES);
+        return value;
+    }
+    if(address >= RAM_BASE && address + size <= RAM_BASE + RAM_SIZE)
+    {
+        memcpy(&value, &ram[address - RAM_BASE], size);
+        return value;
+    }
+    if(address >= PERIPH_BASE && address < PERIPH_BASE + PERIPH_SIZE)
+    {
+        word = PeriphRead(address & ~3);
+    }
+    else if(address >= SYSTICK_BASE && address < SYSTICK_BASE + 0x20)
+    {
+        word = SysTickRead(address & ~3);
+    }
+    else if(address >= PFIC_BASE && address < PFIC_BASE + PFIC_SIZE)
+    {
+        word = PficRead(address & ~3);
+    }
+    else
+    {
+        Fatal("load from unmapped address", address);
+        return 0;
+    }
+    word >>= shift;
+    return size == 4 ? word : word & ((1u << (size * 8)) - 1);
+}
+
+static void Store(uint32_t address, uint32_t value, int size)
+{
+    int shift = (address & 3) * 8;
+    uint32_t mask = (size == 4 ? 0xFFFFFFFF : ((1u << (size * 8)) - 1)) << shift;
+
+    if(address >= RAM_BASE && address + size <= RAM_BASE + RAM_SIZE)
+    {
+        memcpy(&ram[address - RAM_BASE], &value, size);
+        return;
+    }
+    value <<= shift;
+    if(address >= PERIPH_BASE && address < PERIPH_BASE + PERIPH_SIZE)
+    {
+        uint32_t aligned = address & ~3;
+        uint32_t old = periph[(aligned - PERIPH_BASE) / 4];
+        PeriphWrite(aligned, (old & ~mask) | (value & mask));
+    }
+    else if(address >= SYSTICK_BASE && address < SYSTICK_BASE + 0x20)
+    {
+        uint32_t aligned = address & ~3;
+        SysTickWrite(aligned, (SysTickRead(aligned) & ~mask) | (value & mask));
+    }
+    else if(address >= PFIC_BASE && address < PFIC_BASE + PFIC_SIZE)
+    {
+        PficWrite(address & ~3, value & mask, mask);
+    }
+    else
+    {
+        Fatal("store to unmapped address", address);
+    }
+}
+
+static uint16_t Fetch16(uint32_t address)
+{
+    uint16_t value;
+    if(InFlash(address))
+    {
+        uint32_t word = address & ~3;
+        if(word != fetchWord)
+        {
+            fetchWord = word;
+            Tick(FLASH_WAIT_STATES);
+        }
+        memcpy(&value, &flash[address & (FLASH_SIZE - 1)], 2);
+        return value;
+    }
+    if(address >= RAM_BASE && address + 2 <= RAM_BASE + RAM_SIZE)
+    {
+        memcpy(&value, &ram[address - RAM_BASE], 2);
+        return value;
+    }
+    Fatal("fetch from unmapped address", address);
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// Interrupts
+// ------------------------------------------------------------------
+
+static int IrqLevel(int irq)
+{
+    int channel;
+    switch(irq)
+    {
+    case IRQ_SYSTICK:
+        return (systickCtlr & 2) && (systickSr & 1);
+    case IRQ_TIM2:
+    {
+        uint32_t dier = periph[(TIM2_BASE + 0x0C - PERIPH_BASE) / 4];
+        uint32_t intfr = periph[(TIM2_BASE + 0x10 - PERIPH_BASE) / 4];
+        return (dier & intfr & 1) != 0;
+    }
+    case IRQ_USART1:
+    {
+        uint32_t ctlr1 = periph[(USART1_BASE + 0x0C - PERIPH_BASE) / 4];
+        uint32_t statr = PeriphRead(USART1_BASE);
+        return (statr & ctlr1 & 0xF0) != 0;
+    }
+    }
+    channel = irq - IRQ_DMA1_CHANNEL1;
+    if(channel >= 0 && channel < DMA_CHANNEL_COUNT)
+    {
+        return ((dmaFlags >> (channel * 4)) & dma[channel].cfgr & 0xE) != 0;
+    }
+    return 0;
+}
+
+static uint8_t IrqPriority(int irq)
+{
+    return ((uint8_t*)pfic)[0x400 + irq];
+}
+
+// Highest priority enabled interrupt that may preempt now, or 0
+static int IrqSelect(void)
+{
+    int best = 0;
+    uint8_t bestPriority = 0xFF;
+
+    if(irqDepth == 0 ? (csr[CSR_MSTATUS] & 8) == 0 : ((csr[CSR_INTSYSCR] & 2) == 0 || irqDepth >= NEST_LEVELS))
+    {
+        return 0;
+    }
+    for(int word = 0; word < 2; word ++)
+    {
+        uint32_t enabled = irqEnable[word];
+        while(enabled != 0)
+        {
+            int irq = word * 32 + __builtin_ctz(enabled);
+            enabled &= enabled - 1;
+            if((irqPending[word] & (1u << (irq % 32))) == 0 && !IrqLevel(irq))
+            {
+                continue;
+            }
+            if(IrqPriority(irq) < bestPriority)
+            {
+                best = irq;
+                bestPriority = IrqPriority(irq);
+            }
+        }
+    }
+    if(best != 0 && irqDepth > 0 && (bestPriority & 0x80) >= (IrqPriority(irqStack[irqDepth - 1].irq) & 0x80))
+    {
+        return 0;
+    }
+    return best;
+}
+
+static const int hpeRegisters[10] = { 1, 5, 6, 7, 10, 11, 12, 13, 14, 15 };
+
+static void IrqEnter(int irq)
+{
+    IrqFrame* frame = &irqStack[irqDepth ++];
+    uint32_t base = csr[CSR_MTVEC] & ~3;
+
+    frame->irq = irq;
+    frame->start = cycles;
+    frame->mepc = csr[CSR_MEPC];
+    frame->mstatus = csr[CSR_MSTATUS];
+    if(csr[CSR_INTSYSCR] & 1)
+    {
+        for(int i = 0; i < 10; i ++)
+        {
+            frame->hpe[i] = x[hpeRegisters[i]];
+        }
+    }
+    irqPending[irq / 32] &= ~(1u << (irq % 32));
+    csr[CSR_MEPC] = pc;
+    csr[CSR_MCAUSE] = 0x80000000 | irq;
+    csr[CSR_MSTATUS] = (csr[CSR_MSTATUS] & ~0x88) | ((csr[CSR_MSTATUS] & 8) << 4);
+    if((csr[CSR_MTVEC] & 3) == 3)
+    {
+        pc = Load(base + irq * 4, 4);
+    }
+    else
+    {
+        pc = base + irq * 4;
+    }
+    fetchWord = ~0;
+    Tick(CYCLES_IRQ_ENTRY);
+}
+
+// Output samples per second as the firmware paces them now. With SysTick
+// running free the handler moves CMP on by its own period, which only the
+// firmware's RATE_SYMBOL tells.
+static uint32_t OutputRate(void)
+{
+    uint32_t rate;
+    if(tim2NextUpdate != 0)
+    {
+        return HCLK / Tim2Period();
+    }
+    if(systickCtlr & 8)
+    {
+        return HCLK / (systickCmp + 1);
+    }
+    if(rateAddress >= RAM_BASE && rateAddress + 4 <= RAM_BASE + RAM_SIZE)
+    {
+        memcpy(&rate, &ram[rateAddress - RAM_BASE], 4);
+        if(rate != 0)
+        {
+            return rate;
+        }
+    }
+    return WAV_RATE;
+}
+
+// Output sample of one SysTick or TIM2 period, at the rate the firmware
+// programmed. A rate changed later by SysEx keeps the rate of the header.
+static void SampleWrite(void)
+{
+    if(wav.file == NULL)
+    {
+        if(!WavOpen(&wav, wavPath, OutputRate()))
+        {
+            exit(1);
+        }
+    }
+    WavWrite(&wav, tim1Ch4cvr > 255 ? 255 : tim1Ch4cvr);
+}
+
+static void IrqReturn(void)
+{
+    pc = csr[CSR_MEPC];
+    csr[CSR_MSTATUS] = (csr[CSR_MSTATUS] & ~0x88) | ((csr[CSR_MSTATUS] >> 4) & 8) | 0x80;
+    fetchWord = ~0;
+    Tick(CYCLES_MRET);
+    if(irqDepth > 0)
+    {
+        IrqFrame* frame = &irqStack[-- irqDepth];
+        IrqStat* stat = &irqStat[frame->irq];
+        uint32_t spent = (uint32_t)(cycles - frame->start);
+        if(csr[CSR_INTSYSCR] & 1)
+        {
+            for(int i = 0; i < 10; i ++)
+            {
+                x[hpeRegisters[i]] = frame->hpe[i];
+            }
+        }
+        if(irqDepth > 0)
+        {
+            csr[CSR_MEPC] = frame->mepc;
+            csr[CSR_MSTATUS] = frame->mstatus;
+        }
+        if(stat->count == 0 || spent < stat->min)
+        {
+            stat->min = spent;
+        }
+        if(spent > stat->max)
+        {
+            stat->max = spent;
+        }
+        stat->total += spent;
+        ++ stat->count;
+        if(frame->irq == IRQ_SYSTICK && wavPath != NULL)
+        {
+            SampleWrite();
+        }
+    }
+}
+
+// ------------------------------------------------------------------
+// Instruction execution
+// ------------------------------------------------------------------
+
+static uint32_t Reg(uint32_t index)
+{
+    if(index >= 16)
+    {
+        Fatal("RV32E register out of range", index);
+    }
+    return x[index];
+}
+
+static void SetReg(uint32_t index, uint32_t value)
+{
+    if(index >= 16)
+    {
+        Fatal("RV32E register out of range", index);
+    }
+    if(index != 0)
+    {
+        x[index] = value;
+    }
+}
+
+static uint32_t CsrAccess(uint32_t number, uint32_t value, int op, int write)
+{
+    uint32_t old = csr[number];
+    if(write)
+    {
+        switch(op)
+        {
+        case 1: csr[number] = value; break;
+        case 2: csr[number] = old | value; break;
+        case 3: csr[number] = old & ~value; break;
+        }
+    }
+    return old;
+}
+
+static int32_t SignExtend(uint32_t value, int bits)
+{
+    return (int32_t)(value << (32 - bits)) >> (32 - bits);
+}
+
+#define BITS(v, hi, lo)   (((v) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+#define BIT(v, n)         (((v) >> (n)) & 1)
+
+static void Branch(int taken, uint32_t target, uint32_t next)
+{
+    if(taken)
+    {
+        pc = target;
+        fetchWord = ~0;
+        Tick(CYCLES_BRANCH_TAKEN);
+    }
+    else
+    {
+        pc = next;
+        Tick(CYCLES_ALU);
+    }
+}
+
+static void Wfi(void)
+{
+    while(IrqSelect() == 0 && !(irqDepth == 0 && (csr[CSR_MSTATUS] & 8) == 0))
+    {
+        Tick(1);
+        ++ sleepCycles;
+    }
+}
+
+static void Execute32(uint32_t insn)
+{
+    uint32_t opcode = insn & 0x7F;
+    uint32_t rd = BITS(insn, 11, 7);
+    uint32_t rs1 = BITS(insn, 19, 15);
+    uint32_t rs2 = BITS(insn, 24, 20);
+    uint32_t funct3 = BITS(insn, 14, 12);
+    uint32_t funct7 = BITS(insn, 31, 25);
+    int32_t immI = (int32_t)insn >> 20;
+    int32_t immS = ((int32_t)insn >> 25 << 5) | rd;
+    int32_t immB = SignExtend((BIT(insn, 31) << 12) | (BIT(insn, 7) << 11) | (BITS(insn, 30, 25) << 5) | (BITS(insn, 11, 8) << 1), 13);
+    int32_t immJ = SignExtend((BIT(insn, 31) << 20) | (BITS(insn, 19, 12) << 12) | (BIT(insn, 20) << 11) | (BITS(insn, 30, 21) << 1), 21);
+    uint32_t next = pc + 4;
+    uint32_t a, b, value = 0;
+
+    switch(opcode)
+    {
+    case 0x37: // LUI
+        SetReg(rd, insn & 0xFFFFF000);
+        break;
+    case 0x17: // AUIPC
+        SetReg(rd, pc + (insn & 0xFFFFF000));
+        break;
+    case 0x6F: // JAL
+        SetReg(rd, next);
+        pc += immJ;
+        fetchWord = ~0;
+        Tick(CYCLES_JUMP);
+        return;
+    case 0x67: // JALR
+        value = (Reg(rs1) + immI) & ~1;
+        SetReg(rd, next);
+        pc = value;
+        fetchWord = ~0;
+        Tick(CYCLES_JUMP_REGISTER);
+        return;
+    case 0x63: // BRANCH
+        a = Reg(rs1);
+        b = Reg(rs2);
+        switch(funct3)
+        {
+        case 0: Branch(a == b, pc + immB, next); return;
+        case 1: Branch(a != b, pc + immB, next); return;
+        case 4: Branch((int32_t)a < (int32_t)b, pc + immB, next); return;
+        case 5: Branch((int32_t)a >= (int32_t)b, pc + immB, next); return;
+        case 6: Branch(a < b, pc + immB, next); return;
+        case 7: Branch(a >= b, pc + immB, next); return;
+        }
+        Fatal("illegal branch", insn);
+        return;
+    case 0x03: // LOAD
+        a = Reg(rs1) + immI;
+        switch(funct3)
+        {
+        case 0: value = SignExtend(Load(a, 1), 8); break;
+        case 1: value = SignExtend(Load(a, 2), 16); break;
+        case 2: value = Load(a, 4); break;
+        case 4: value = Load(a, 1); break;
+        case 5: value = Load(a, 2); break;
+        default: Fatal("illegal load", insn);
+        }
+        SetReg(rd, value);
+        pc = next;
+        Tick(CYCLES_LOAD);
+        return;
+    case 0x23: // STORE
+        a = Reg(rs1) + immS;
+        if(funct3 > 2)
+        {
+            Fatal("illegal store", insn);
+        }
+        Store(a, Reg(rs2), 1 << funct3);
+        pc = next;
+        Tick(CYCLES_STORE);
+        return;
+    case 0x13: // OP-IMM
+        a = Reg(rs1);
+        switch(funct3)
+        {
+        case 0: value = a + immI; break;
+        case 1: value = a << (immI & 31); break;
+        case 2: value = (int32_t)a < immI; break;
+        case 3: value = a < (uint32_t)immI; break;
+        case 4: value = a ^ immI; break;
+        case 5: value = (funct7 & 0x20) ? (uint32_t)((int32_t)a >> (immI & 31)) : a >> (immI & 31); break;
+        case 6: value = a | immI; break;
+        case 7: value = a & immI; break;
+        }
+        SetReg(rd, value);
+        break;
+    case 0x33: // OP (no M extension on the CH32V003)
+        if(funct7 & ~0x20)
+        {
+            Fatal("illegal instruction", insn);
+        }
+        a = Reg(rs1);
+        b = Reg(rs2);
+        switch(funct3)
+        {
+        case 0: value = (funct7 & 0x20) ? a - b : a + b; break;
+        case 1: value = a << (b & 31); break;
+        case 2: value = (int32_t)a < (int32_t)b; break;
+        case 3: value = a < b; break;
+        case 4: value = a ^ b; break;
+        case 5: value = (funct7 & 0x20) ? (uint32_t)((int32_t)a >> (b & 31)) : a >> (b & 31); break;
+        case 6: value = a | b; break;
+        case 7: value = a & b; break;
+        }
+        SetReg(rd, value);
+        break;
+    case 0x0F: // FENCE
+        break;
+    case 0x73: // SYSTEM
+        if(funct3 == 0)
+        {
+            if(insn == 0x30200073)
+            {
+                IrqReturn();
+                return;
+            }
+            if(insn == 0x10500073)
+            {
+                pc = next;
+                Tick(CYCLES_ALU);
+                Wfi();
+                return;
+            }
+            Fatal("ecall/ebreak", insn);
+        }
+        value = CsrAccess(insn >> 20, (funct3 & 4) ? rs1 : Reg(rs1), funct3 & 3, (funct3 & 3) == 1 || rs1 != 0);
+        SetReg(rd, value);
+        break;
+    default:
+        Fatal("illegal instruction", insn);
+    }
+    pc = next;
+    Tick(CYCLES_ALU);
+}
+
+// Compressed register fields x8-x15
+#define CREG(v)   (8 + (v))
+
+static void Execute16(uint32_t insn)
+{
+    uint32_t quadrant = insn & 3;
+    uint32_t funct3 = BITS(insn, 15, 13);
+    uint32_t rdFull = BITS(insn, 11, 7);
+    uint32_t rs2Full = BITS(insn, 6, 2);
+    uint32_t rdShort = CREG(BITS(insn, 4, 2));
+    uint32_t rs1Short = CREG(BITS(insn, 9, 7));
+    uint32_t next = pc + 2;
+    uint32_t offset, address;
+    int32_t imm;
+
+    switch((quadrant << 3) | funct3)
+    {
+    // Quadrant 0
+    case 000:
+        offset = (BITS(insn, 10, 7) << 6) | (BITS(insn, 12, 11) << 4) | (BIT(insn, 5) << 3) | (BIT(insn, 6) << 2);
+        if(offset == 0)
+        {
+            Fatal("illegal instruction", insn);
+        }
+        SetReg(rdShort, Reg(2) + offset);                         // c.addi4spn
+        break;
+    case 001:
+        // XW c.lbu, uimm[4:1] placed as in c.lhu and uimm[0] at bit 12
+        offset = (BIT(insn, 12)) | (BITS(insn, 11, 10) << 3) | (BIT(insn, 6) << 2) | (BIT(insn, 5) << 1);
+        if(BIT(insn, 12))
+        {
+            Unconfirmed(insn);
+        }
+        SetReg(rdShort, Load(Reg(rs1Short) + offset, 1));
+        pc = next;
+        Tick(CYCLES_LOAD);
+        return;
+    case 002:
+        offset = (BITS(insn, 12, 10) << 3) | (BIT(insn, 6) << 2) | (BIT(insn, 5) << 6);
+        SetReg(rdShort, Load(Reg(rs1Short) + offset, 4));       // c.lw
+        pc = next;
+        Tick(CYCLES_LOAD);
+        return;
+    case 004:
+        // XW c.lbusp/c.lhusp/c.sbsp/c.shsp, selected by bits 6:5, with
+        // uimm[0] of the byte forms at bit 11. obj/BeepMidi.lst has only
+        // c.shsp, and none with uimm[5].
+        offset = (BIT(insn, 7) << 4) | (BITS(insn, 10, 8) << 1) | (BIT(insn, 12) << 5);
+        if(BITS(insn, 6, 5) != 3 || BIT(insn, 12))
+        {
+            Unconfirmed(insn);
+        }
+        switch(BITS(insn, 6, 5))
+        {
+        case 0:
+            SetReg(rdShort, Load(Reg(2) + offset + BIT(insn, 11), 1));
+            Tick(CYCLES_LOAD);
+            break;
+        case 1:
+            SetReg(rdShort, Load(Reg(2) + offset, 2));
+            Tick(CYCLES_LOAD);
+            break;
+        case 2:
+            Store(Reg(2) + offset + BIT(insn, 11), Reg(rdShort), 1);
+            Tick(CYCLES_STORE);
+            break;
+        case 3:
+            Store(Reg(2) + offset, Reg(rdShort), 2);
+            Tick(CYCLES_STORE);
+            break;
+        }
+        pc = next;
+        return;
+    case 005:
+        // XW c.sb, offset as c.lbu
+        offset = (BIT(insn, 12)) | (BITS(insn, 11, 10) << 3) | (BIT(insn, 6) << 2) | (BIT(insn, 5) << 1);
+        if(BIT(insn, 12))
+        {
+            Unconfirmed(insn);
+        }
+        Store(Reg(rs1Short) + offset, Reg(rdShort), 1);
+        pc = next;
+        Tick(CYCLES_STORE);
+        return;
+    case 006:
+        offset = (BITS(insn, 12, 10) << 3) | (BIT(insn, 6) << 2) | (BIT(insn, 5) << 6);
+        Store(Reg(rs1Short) + offset, Reg(rdShort), 4);          // c.sw
+        pc = next;
+        Tick(CYCLES_STORE);
+        return;
+
+    // Quadrant 1
+    case 010:
+        imm = SignExtend((BIT(insn, 12) << 5) | rs2Full, 6);
+        SetReg(rdFull, Reg(rdFull) + imm);                        // c.addi
+        break;
+    case 011:
+    case 015:
+        imm = SignExtend((BIT(insn, 12) << 11) | (BIT(insn, 8) << 10) | (BITS(insn, 10, 9) << 8) | (BIT(insn, 6) << 7) |
+                         (BIT(insn, 7) << 6) | (BIT(insn, 2) << 5) | (BIT(insn, 11) << 4) | (BITS(insn, 5, 3) << 1), 12);
+        if(funct3 == 1)
+        {
+            SetReg(1, next);                                      // c.jal
+        }
+        pc += imm;                                                // c.j
+        fetchWord = ~0;
+        Tick(CYCLES_JUMP);
+        return;
+    case 012:
+        SetReg(rdFull, SignExtend((BIT(insn, 12) << 5) | rs2Full, 6));   // c.li
+        break;
+    case 013:
+        if(rdFull == 2)
+        {
+            imm = SignExtend((BIT(insn, 12) << 9) | (BITS(insn, 4, 3) << 7) | (BIT(insn, 5) << 6) | (BIT(insn, 2) << 5) | (BIT(insn, 6) << 4), 10);
+            SetReg(2, Reg(2) + imm);                              // c.addi16sp
+        }
+        else
+        {
+            SetReg(rdFull, SignExtend((BIT(insn, 12) << 17) | (rs2Full << 12), 18));   // c.lui
+        }
+        break;
+    case 014:
+    {
+        uint32_t rd = rs1Short;
+        uint32_t shamt = (BIT(insn, 12) << 5) | rs2Full;
+        switch(BITS(insn, 11, 10))
+        {
+        case 0: SetReg(rd, Reg(rd) >> shamt); break;                          // c.srli
+        case 1: SetReg(rd, (uint32_t)((int32_t)Reg(rd) >> shamt)); break;     // c.srai
+        case 2: SetReg(rd, Reg(rd) & SignExtend(shamt, 6)); break;            // c.andi
+        case 3:
+            if(BIT(insn, 12))
+            {
+                Fatal("illegal instruction", insn);
+            }
+            switch(BITS(insn, 6, 5))
+            {
+            case 0: SetReg(rd, Reg(rd) - Reg(rdShort)); break;                // c.sub
+            case 1: SetReg(rd, Reg(rd) ^ Reg(rdShort)); break;                // c.xor
+            case 2: SetReg(rd, Reg(rd) | Reg(rdShort)); break;                // c.or
+            case 3: SetReg(rd, Reg(rd) & Reg(rdShort)); break;                // c.and
+            }
+            break;
+        }
+        break;
+    }
+    case 016:
+    case 017:
+        imm = SignExtend((BIT(insn, 12) << 8) | (BITS(insn, 6, 5) << 6) | (BIT(insn, 2) << 5) | (BITS(insn, 11, 10) << 3) | (BITS(insn, 4, 3) << 1), 9);
+        if(funct3 == 6)
+        {
+            Branch(Reg(rs1Short) == 0, pc + imm, next);           // c.beqz
+        }
+        else
+        {
+            Branch(Reg(rs1Short) != 0, pc + imm, next);           // c.bnez
+        }
+        return;
+
+    // Quadrant 2
+    case 020:
+        SetReg(rdFull, Reg(rdFull) << ((BIT(insn, 12) << 5) | rs2Full));   // c.slli
+        break;
+    case 021:
+        // XW c.lhu
+        offset = (BIT(insn, 12) << 5) | (BITS(insn, 11, 10) << 3) | (BIT(insn, 6) << 2) | (BIT(insn, 5) << 1);
+        SetReg(rdShort, Load(Reg(rs1Short) + offset, 2));
+        pc = next;
+        Tick(CYCLES_LOAD);
+        return;
+    case 022:
+        offset = (BIT(insn, 12) << 5) | (BITS(insn, 6, 4) << 2) | (BITS(insn, 3, 2) << 6);
+        SetReg(rdFull, Load(Reg(2) + offset, 4));                 // c.lwsp
+        pc = next;
+        Tick(CYCLES_LOAD);
+        return;
+    case 024:
+        if(BIT(insn, 12) == 0)
+        {
+            if(rs2Full == 0)
+            {
+                pc = Reg(rdFull) & ~1;                            // c.jr
+                fetchWord = ~0;
+                Tick(CYCLES_JUMP_REGISTER);
+                return;
+            }
+            SetReg(rdFull, Reg(rs2Full));                         // c.mv
+        }
+        else if(rs2Full == 0)
+        {
+            if(rdFull == 0)
+            {
+                Fatal("c.ebreak", insn);
+            }
+            address = Reg(rdFull) & ~1;                           // c.jalr
+            SetReg(1, next);
+            pc = address;
+            fetchWord = ~0;
+            Tick(CYCLES_JUMP_REGISTER);
+            return;
+        }
+        else
+        {
+            SetReg(rdFull, Reg(rdFull) + Reg(rs2Full));           // c.add
+        }
+        break;
+    case 025:
+        // XW c.sh
+        offset = (BIT(insn, 12) << 5) | (BITS(insn, 11, 10) << 3) | (BIT(insn, 6) << 2) | (BIT(insn, 5) << 1);
+        Store(Reg(rs1Short) + offset, Reg(rdShort), 2);
+        pc = next;
+        Tick(CYCLES_STORE);
+        return;
+    case 026:
+        offset = (BITS(insn, 12, 9) << 2) | (BITS(insn, 8, 7) << 6);
+        Store(Reg(2) + offset, Reg(rs2Full), 4);                  // c.swsp
+        pc = next;
+        Tick(CYCLES_STORE);
+        return;
+    default:
+        Fatal("illegal compressed instruction", insn);
+    }
+    pc = next;
+    Tick(CYCLES_ALU);
+}
+
+static void Step(void)
+{
+    int irq = IrqSelect();
+    uint32_t insn;
+
+    if(irq != 0)
+    {
+        IrqEnter(irq);
+    }
+    insn = Fetch16(pc);
+    if((insn & 3) == 3)
+    {
+        insn |= (uint32_t)Fetch16(pc + 2) << 16;
+        Execute32(insn);
+    }
+    else
+    {
+        Execute16(insn);
+    }
+}
+
+// ------------------------------------------------------------------
+// ELF loader
+// ------------------------------------------------------------------
+
+static uint32_t ReadLE(const uint8_t* p, int length)
+{
+    uint32_t value = 0;
+    for(int i = length - 1; i >= 0; i --)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// Value of the named symbol from the first SHT_SYMTAB, 0 if there is none
+static uint32_t ElfSymbol(FILE* file, const uint8_t* header, const char* name)
+{
+    uint32_t shoff = ReadLE(header + 32, 4);
+    uint32_t shentsize = ReadLE(header + 46, 2);
+    uint32_t shnum = ReadLE(header + 48, 2);
+    size_t length = strlen(name) + 1;
+    for(uint32_t i = 0; i < shnum; i ++)
+    {
+        uint8_t sh[40], strtab[40];
+        uint32_t offset, size, stroff, strsize;
+        fseek(file, shoff + i * shentsize, SEEK_SET);
+        if(fread(sh, 1, sizeof(sh), file) != sizeof(sh))
+        {
+            return 0;
+        }
+        if(ReadLE(sh + 4, 4) != 2)
+        {
+            continue;
+        }
+        fseek(file, shoff + ReadLE(sh + 24, 4) * shentsize, SEEK_SET);
+        if(fread(strtab, 1, sizeof(strtab), file) != sizeof(strtab))
+        {
+            return 0;
+        }
+        offset = ReadLE(sh + 16, 4);
+        size = ReadLE(sh + 20, 4);
+        stroff = ReadLE(strtab + 16, 4);
+        strsize = ReadLE(strtab + 20, 4);
+        for(uint32_t j = 0; j + 16 <= size; j += 16)
+        {
+            uint8_t sym[16];
+            char symName[64];
+            uint32_t nameOffset;
+            fseek(file, offset + j, SEEK_SET);
+            if(fread(sym, 1, sizeof(sym), file) != sizeof(sym))
+            {
+                return 0;
+            }
+            nameOffset = ReadLE(sym, 4);
+            if(length > sizeof(symName) || nameOffset + length > strsize)
+            {
+                continue;
+            }
+            fseek(file, stroff + nameOffset, SEEK_SET);
+            if(fread(symName, 1, length, file) == length && memcmp(symName, name, length) == 0)
+            {
+                return ReadLE(sym + 4, 4);
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+// Copy every PT_LOAD segment to its load address, as the programmer would,
+// and find RATE_SYMBOL
+static int LoadElf(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    uint8_t header[52];
+    uint32_t phoff, phnum, phentsize;
+
+    if(file == NULL)
+    {
+        perror(path);
+        return 0;
+    }
+    if(fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "\177ELF", 4) != 0 ||
+       header[4] != 1 || header[5] != 1 || ReadLE(header + 18, 2) != 0xF3)
+    {
+        fprintf(stderr, "rv32sim: %s is not a 32bit little endian RISC-V ELF\n", path);
+        fclose(file);
+        return 0;
+    }
+    pc = ReadLE(header + 24, 4);
+    phoff = ReadLE(header + 28, 4);
+    phentsize = ReadLE(header + 42, 2);
+    phnum = ReadLE(header + 44, 2);
+    for(uint32_t i = 0; i < phnum; i ++)
+    {
+        uint8_t ph[32];
+        uint32_t offset, paddr, filesz;
+        fseek(file, phoff + i * phentsize, SEEK_SET);
+        if(fread(ph, 1, sizeof(ph), file) != sizeof(ph))
+        {
+            break;
+        }
+        if(ReadLE(ph, 4) != 1 || ReadLE(ph + 16, 4) == 0)
+        {
+            continue;
+        }
+        offset = ReadLE(ph + 4, 4);
+        paddr = ReadLE(ph + 12, 4);
+        filesz = ReadLE(ph + 16, 4);
+        fseek(file, offset, SEEK_SET);
+        if(InFlash(paddr) && (paddr & (FLASH_SIZE - 1)) + filesz <= FLASH_SIZE)
+        {
+            if(fread(&flash[paddr & (FLASH_SIZE - 1)], 1, filesz, file) != filesz)
+            {
+                break;
+            }
+        }
+        else if(paddr >= RAM_BASE && paddr + filesz <= RAM_BASE + RAM_SIZE)
+        {
+            // RAM image of a segment that is not in flash, loaded by a debugger
+            if(fread(&ram[paddr - RAM_BASE], 1, filesz, file) != filesz)
+            {
+                break;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "rv32sim: segment at 0x%08x does not fit the CH32V003 memory map\n", paddr);
+            fclose(file);
+            return 0;
+        }
+    }
+    rateAddress = ElfSymbol(file, header, RATE_SYMBOL);
+    fclose(file);
+    if(rateAddress == 0)
+    {
+        fprintf(stderr, "rv32sim: %s has no %s; build the firmware from this tree\n", path, RATE_SYMBOL);
+        return 0;
+    }
+    return 1;
+}
+
+// ------------------------------------------------------------------
+
+static void Report(void)
+{
+    // SysTick either reloads at CMP, or runs free with the handler moving
+    // CMP on by one output tick
+    uint32_t period = (systickCtlr & 8) ? systickCmp + 1 : HCLK / OutputRate();
+    uint64_t mainCycles = cycles - sleepCycles;
+    for(int irq = 0; irq < IRQ_COUNT; irq ++)
+    {
+        mainCycles -= irqStat[irq].total;
+    }
+    printf("%llu cycles (%.3f s at %d MHz), %zu of %zu input bytes received\n",
+           (unsigned long long)cycles, (double)cycles / HCLK, HCLK / 1000000, stream.position, stream.count);
+    printf("%llu cycles (%.1f%%) asleep in WFI\n", (unsigned long long)sleepCycles, 100.0 * sleepCycles / cycles);
+    // Parsing and voice allocation cost, when the firmware sleeps while idle.
+    // A nested handler is also inside the total of the one it preempted, so
+    // this reads slightly low then.
+    printf("%llu cycles (%.1f%%) in the main loop, %.1f per input byte\n", (unsigned long long)mainCycles,
+           100.0 * mainCycles / cycles, stream.position ? (double)mainCycles / stream.position : 0.0);
+    printf("%-14s %10s %8s %10s %8s\n", "handler", "count", "min", "mean", "max");
+    for(int irq = 0; irq < IRQ_COUNT; irq ++)
+    {
+        IrqStat* stat = &irqStat[irq];
+        if(stat->count == 0)
+        {
+            continue;
+        }
+        printf("%-14s %10llu %8u %10.1f %8u", irqNames[irq] ? irqNames[irq] : "?",
+               (unsigned long long)stat->count, stat->min, (double)stat->total / stat->count, stat->max);
+        if(irq == IRQ_SYSTICK && (systickCtlr & 2))
+        {
+            printf("   budget %u: mean %.1f%%, max %.1f%%", period,
+                   100.0 * stat->total / stat->count / period, 100.0 * stat->max / period);
+        }
+        if(irq == IRQ_DMA1_CHANNEL1 + 1 && tim2NextUpdate != 0 && (dma[1].cfgr & 4))
+        {
+            // Half of the TIM2 paced buffer per interrupt
+            uint64_t budget = Tim2Period() * (dma[1].reload / 2);
+            printf("   budget %llu: mean %.1f%%, max %.1f%%", (unsigned long long)budget,
+                   100.0 * stat->total / stat->count / budget, 100.0 * stat->max / budget);
+        }
+        printf("\n");
+    }
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: rv32sim [-r] [-s] [-b bps] [-t seconds] [-w out.wav] [-u tx.bin] firmware.elf input\n"
+                    "  -r          input is a raw serial byte stream\n"
+                    "  -s          send MIDI file events with running status\n"
+                    "  -b bps      serial bit rate (default %d)\n"
+                    "  -t seconds  time simulated after the last byte (default %.1f)\n"
+                    "  -w out.wav  write TIM1 CH4CVR after every SysTick handler or TIM2 DMA transfer\n"
+                    "  -u tx.bin   write bytes sent on USART1 TX\n",
+                    SERIAL_BPS, TAIL_SECONDS);
+}
+
+int main(int argc, char* argv[])
+{
+    int raw = 0;
+    int runningStatus = 0;
+    double tail = TAIL_SECONDS;
+    const char* txPath = NULL;
+    int option;
+    uint64_t end;
+
+    bps = SERIAL_BPS;
+    while((option = getopt(argc, argv, "rsb:t:w:u:")) != -1)
+    {
+        switch(option)
+        {
+        case 'r':
+            raw = 1;
+            break;
+        case 's':
+            runningStatus = 1;
+            break;
+        case 'b':
+            bps = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            tail = atof(optarg);
+            break;
+        case 'w':
+            wavPath = optarg;
+            break;
+        case 'u':
+            txPath = optarg;
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+    if(argc - optind != 2 || bps == 0 || tail < 0.0)
+    {
+        Usage();
+        return 1;
+    }
+
+    // Stream times are in units of 1/(HCLK*bps) second, so one cycle is bps units
+    MidiStreamInitialize(&stream, (uint64_t)HCLK * bps, (uint64_t)SERIAL_BITS * HCLK);
+    stream.runningStatus = runningStatus;
+    if(!LoadElf(argv[optind]) || !MidiStreamLoadFile(&stream, argv[optind + 1], raw))
+    {
+        return 1;
+    }
+    if(txPath != NULL && (txFile = fopen(txPath, "wb")) == NULL)
+    {
+        perror(txPath);
+        return 1;
+    }
+
+    fetchWord = ~0;
+    end = (stream.lastArrival + (uint64_t)(tail * stream.unitsPerSecond)) / bps;
+    while(cycles < end)
+    {
+        Step();
+    }
+
+    Report();
+    if(wav.file != NULL)
+    {
+        WavClose(&wav);
+    }
+    if(txFile != NULL)
+    {
+        fclose(txFile);
+    }
+    MidiStreamFree(&stream);
+    return 0;
+}
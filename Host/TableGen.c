@@ -0,0 +1,262 @@
+// Table generator for the BeepMidi synth core
+//
+//  Usage: tablegen output
+//
+//  Input:  User/BeepConfig.h, compiled in
+//  Output: BeepTables.h for User/BeepSynth.c and User/NoiseDrum.c
+//
+// Every constant table the synth renders with is computed here, so a
+// different rate, tuning or curve is a change to BeepConfig.h only. The
+// output repeats the settings it was made for and stops the build with
+// #error when BeepConfig.h no longer matches.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "BeepConfig.h"
+
+// Highest mixer sum, every voice and drum at full gain
+#define MIX_MAX           ((CHANNEL_COUNT + DRUM_COUNT) * 255)
+// Mixer sums below this are divided exactly instead of looked up
+#define SOFT_CLIP_LINEAR  (SOFT_CLIP_KNEE * PSG_DEVIDE_FACTOR)
+// Most softClip entries. The sums per entry, as a shift, is the smallest
+// that fits every entry up to MIX_MAX, or to the first 255, in as many.
+#define SOFT_CLIP_MAX_LENGTH 512
+// Notes 108-119, the highest full octave
+#define TONE_TOP_NOTE     108
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: tablegen output\n");
+}
+
+static void WriteTable(FILE* file, const char* declaration, const uint32_t* data, int count, int perLine)
+{
+    fprintf(file, "%s[%d] =\n{", declaration, count);
+    for(int i = 0; i < count; i ++)
+    {
+        fprintf(file, "%s%u%s", i % perLine == 0 ? "\n    " : " ", data[i], i + 1 < count ? "," : "\n");
+    }
+    fprintf(file, "};\n");
+}
+
+// 256 * 2^((level - 15) / VOLUME_LOG_STEPS), rounded down, at most 255
+static uint32_t LogVolume(int level)
+{
+    double value = floor(256.0 * pow(2.0, (level - 15) / (double)VOLUME_LOG_STEPS));
+    return level == 0 ? 0 : value > 255.0 ? 255 : (uint32_t)value;
+}
+
+// Duty for the middle of the mixer sums of one softClip entry, rounded
+static uint32_t SoftClip(int index, int shift)
+{
+    double x = (SOFT_CLIP_LINEAR + index * (1 << shift) + ((1 << shift) - 1) / 2.0) / PSG_DEVIDE_FACTOR;
+    double range = 255.0 - SOFT_CLIP_KNEE;
+    double y = x <= SOFT_CLIP_KNEE ? x : SOFT_CLIP_KNEE + range * (1.0 - exp(-(x - SOFT_CLIP_KNEE) / range));
+    return (uint32_t)floor(y + 0.5);
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t tone[12];
+    uint32_t gain[16];
+    uint32_t drum[17];
+    uint32_t clip[SOFT_CLIP_MAX_LENGTH + 1];
+    int clipLength;
+    int clipShift;
+    int reciprocalShift;
+    uint32_t reciprocal = 0;
+    int overrideLevel[17];
+    int overrideCount = 0;
+    FILE* file;
+
+    if(argc != 2)
+    {
+        Usage();
+        return 1;
+    }
+    if(SOFT_CLIP_KNEE >= 255 || PSG_DEVIDE_FACTOR <= 0 || VOLUME_LOG_STEPS <= 0)
+    {
+        fprintf(stderr, "tablegen: bad PSG_DEVIDE_FACTOR, SOFT_CLIP_KNEE or VOLUME_LOG_STEPS\n");
+        return 1;
+    }
+    // BeepSynthGetData sums into a uint16_t
+    if(CHANNEL_COUNT < 1 || DRUM_COUNT < 0 || MIX_MAX > 65535)
+    {
+        fprintf(stderr, "tablegen: bad CHANNEL_COUNT or DRUM_COUNT\n");
+        return 1;
+    }
+
+    if(SAMPLING_FREQUENCY_MIN > OUTPUT_SAMPLING_FREQUENCY || OUTPUT_SAMPLING_FREQUENCY > SAMPLING_FREQUENCY_MAX)
+    {
+        fprintf(stderr, "tablegen: OUTPUT_SAMPLING_FREQUENCY is outside SAMPLING_FREQUENCY_MIN to _MAX\n");
+        return 1;
+    }
+    for(int i = 0; i < 12; i ++)
+    {
+        double frequency = TUNING_A4_MILLIHERTZ / 1000.0 * pow(2.0, (TONE_TOP_NOTE + i - 69) / 12.0);
+        double increment = floor(frequency * 4294967296.0 / OUTPUT_SAMPLING_FREQUENCY + 0.5);
+        if(increment >= 4294967296.0)
+        {
+            fprintf(stderr, "tablegen: note %d is above OUTPUT_SAMPLING_FREQUENCY\n", TONE_TOP_NOTE + i);
+            return 1;
+        }
+        tone[i] = (uint32_t)increment;
+        // BeepSynthSetSamplingFrequency rescales tone[] to the rate in 32
+        // bits, and the slowest rate gives the largest increment
+        if(floor((increment * OUTPUT_SAMPLING_FREQUENCY + SAMPLING_FREQUENCY_MIN / 2) / SAMPLING_FREQUENCY_MIN) >= 4294967296.0)
+        {
+            fprintf(stderr, "tablegen: note %d is above SAMPLING_FREQUENCY_MIN\n", TONE_TOP_NOTE + i);
+            return 1;
+        }
+    }
+    for(int i = 0; i < 16; i ++)
+    {
+#if VOICE_VOLUME_CURVE == VOLUME_CURVE_LINEAR
+        gain[i] = i == 0 ? 0 : (i + 1) * 16 > 255 ? 255 : (uint32_t)(i + 1) * 16;
+#else
+        gain[i] = LogVolume(i);
+#endif
+    }
+    for(int i = 0; i < 17; i ++)
+    {
+        drum[i] = LogVolume(i);
+    }
+    // Listed in the output, which checks each against BeepConfig.h
+#define DRUM_VOLUME(level, value) \
+    if((level) < 0 || (level) > 16 || (value) < 0 || (value) > 255) \
+    { \
+        fprintf(stderr, "tablegen: bad DRUM_VOLUME(%d, %d)\n", (level), (value)); \
+        return 1; \
+    } \
+    for(int i = 0; i < overrideCount; i ++) \
+    { \
+        if(overrideLevel[i] == (level)) \
+        { \
+            fprintf(stderr, "tablegen: DRUM_VOLUME(%d, ...) given twice\n", (level)); \
+            return 1; \
+        } \
+    } \
+    drum[level] = (value); \
+    overrideLevel[overrideCount ++] = (level);
+    DRUM_VOLUME_OVERRIDES
+#undef DRUM_VOLUME
+    // Smallest ceil(2^shift / PSG_DEVIDE_FACTOR) whose product is at most one
+    // too high below SOFT_CLIP_LINEAR, so the firmware corrects it with one
+    // compare; a small constant multiplies with a few shifts and adds
+    for(reciprocalShift = 1; reciprocalShift <= 16; reciprocalShift ++)
+    {
+        int x;
+        reciprocal = ((1UL << reciprocalShift) + PSG_DEVIDE_FACTOR - 1) / PSG_DEVIDE_FACTOR;
+        for(x = 0; x < SOFT_CLIP_LINEAR; x ++)
+        {
+            uint32_t estimate = ((uint32_t)x * reciprocal) >> reciprocalShift;
+            if(estimate < (uint32_t)x / PSG_DEVIDE_FACTOR || estimate > (uint32_t)x / PSG_DEVIDE_FACTOR + 1)
+            {
+                break;
+            }
+        }
+        if(x == SOFT_CLIP_LINEAR)
+        {
+            break;
+        }
+    }
+    if(reciprocalShift > 16)
+    {
+        fprintf(stderr, "tablegen: no reciprocal for PSG_DEVIDE_FACTOR\n");
+        return 1;
+    }
+    // Up to the entry holding MIX_MAX, or the first at 255 before it; the
+    // firmware reads sums past the end from the last entry
+    for(clipShift = 0; ; clipShift ++)
+    {
+        clipLength = 0;
+        do
+        {
+            clip[clipLength] = SoftClip(clipLength, clipShift);
+            ++ clipLength;
+        }
+        while(clip[clipLength - 1] < 255 && SOFT_CLIP_LINEAR + (clipLength << clipShift) <= MIX_MAX
+              && clipLength <= SOFT_CLIP_MAX_LENGTH);
+        if(clipLength <= SOFT_CLIP_MAX_LENGTH)
+        {
+            break;
+        }
+    }
+
+    file = fopen(argv[1], "w");
+    if(file == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(file, "// Generated by Host/TableGen.c from BeepConfig.h, do not edit.\n"
+                  "// make -C Host tables writes it again.\n"
+                  "#ifndef BEEPTABLES_H\n"
+                  "#define BEEPTABLES_H\n"
+                  "\n"
+                  "#include <stdint.h>\n"
+                  "#include \"BeepConfig.h\"\n"
+                  "\n"
+                  "#if OUTPUT_SAMPLING_FREQUENCY != %d || TUNING_A4_MILLIHERTZ != %d || PSG_DEVIDE_FACTOR != %d \\\n"
+                  "    || SOFT_CLIP_KNEE != %d || VOICE_VOLUME_CURVE != %d || VOLUME_LOG_STEPS != %d \\\n"
+                  "    || CHANNEL_COUNT != %d || DRUM_COUNT != %d\n"
+                  "#error \"BeepTables.h is out of date, run make -C Host tables\"\n"
+                  "#endif\n"
+                  "\n",
+                  OUTPUT_SAMPLING_FREQUENCY, TUNING_A4_MILLIHERTZ, PSG_DEVIDE_FACTOR,
+                  SOFT_CLIP_KNEE, VOICE_VOLUME_CURVE, VOLUME_LOG_STEPS,
+                  CHANNEL_COUNT, DRUM_COUNT);
+    // The overrides as they were, then every DRUM_VOLUME in BeepConfig.h
+    // has to name one of them with the same value, and as many of them
+    fprintf(file, "// DRUM_VOLUME_OVERRIDES the tables were made with, level and value\n"
+                  "#define TABLE_DRUM_VOLUME_OVERRIDE_COUNT %d\n", overrideCount);
+    for(int i = 0; i < overrideCount; i ++)
+    {
+        fprintf(file, "#define TABLE_DRUM_VOLUME_%d %u\n", overrideLevel[i], drum[overrideLevel[i]]);
+    }
+    fprintf(file, "#define DRUM_VOLUME(level, value) + 1\n"
+                  "#if (0 DRUM_VOLUME_OVERRIDES) != TABLE_DRUM_VOLUME_OVERRIDE_COUNT\n"
+                  "#error \"BeepTables.h is out of date, run make -C Host tables\"\n"
+                  "#endif\n"
+                  "#undef DRUM_VOLUME\n"
+                  "#define DRUM_VOLUME(level, value) \\\n"
+                  "    _Static_assert(TABLE_DRUM_VOLUME_##level == (value), \"BeepTables.h is out of date, run make -C Host tables\");\n"
+                  "DRUM_VOLUME_OVERRIDES\n"
+                  "#undef DRUM_VOLUME\n"
+                  "\n");
+    fprintf(file, "// Phase increment per output sample for notes %d-%d at\n"
+                  "// OUTPUT_SAMPLING_FREQUENCY: round(A4 * 2^((note - 69) / 12) * 2^32 / rate)\n",
+                  TONE_TOP_NOTE, TONE_TOP_NOTE + 11);
+    fprintf(file, "#define TONE_TOP_OCTAVE %d\n", TONE_TOP_NOTE / 12);
+    WriteTable(file, "static const uint32_t toneIncrementReference", tone, 12, 6);
+    fprintf(file, "\n// Voice gain per MIDI channel volume\n");
+    WriteTable(file, "static const uint8_t psg_volume", gain, 16, 16);
+    fprintf(file, "\n// Drum level to gain, 256 * 2^((level - 15) / %d) rounded down, but for\n"
+                  "// DRUM_VOLUME_OVERRIDES\n", VOLUME_LOG_STEPS);
+    WriteTable(file, "static const uint8_t volumeTable", drum, 17, 17);
+    fprintf(file, "\n// Mixer sum to PWM duty. Below SOFT_CLIP_LINEAR it is sum / %d, from\n"
+                  "// (sum * SOFT_CLIP_RECIPROCAL) >> SOFT_CLIP_RECIPROCAL_SHIFT less one if that\n"
+                  "// is too high. From there softClip is indexed by\n"
+                  "// (sum - SOFT_CLIP_LINEAR) >> SOFT_CLIP_SHIFT, rounded with x taken at the\n"
+                  "// middle of each index:\n"
+                  "//   x = (%d + index * %d + %.1f) / %d; y = %d + %d * (1 - exp(-(x - %d) / %d))\n"
+                  "// The table ends at the highest sum, %d for %d voices and %d drums, or at\n"
+                  "// the first 255; sums past the end take the last entry.\n",
+                  PSG_DEVIDE_FACTOR, SOFT_CLIP_LINEAR, 1 << clipShift, ((1 << clipShift) - 1) / 2.0,
+                  PSG_DEVIDE_FACTOR, SOFT_CLIP_KNEE, 255 - SOFT_CLIP_KNEE, SOFT_CLIP_KNEE, 255 - SOFT_CLIP_KNEE,
+                  MIX_MAX, CHANNEL_COUNT, DRUM_COUNT);
+    fprintf(file, "#define SOFT_CLIP_LINEAR %d\n", SOFT_CLIP_LINEAR);
+    fprintf(file, "#define SOFT_CLIP_RECIPROCAL %u\n", reciprocal);
+    fprintf(file, "#define SOFT_CLIP_RECIPROCAL_SHIFT %d\n", reciprocalShift);
+    fprintf(file, "#define SOFT_CLIP_SHIFT %d\n", clipShift);
+    WriteTable(file, "static const uint8_t softClip", clip, clipLength, 16);
+    fprintf(file, "\n#endif\n");
+
+    if(fclose(file) != 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+// Decoder for the telemetry frames sent on USART1 TX
+//
+//  Usage: teledump [-b budget] capture
+//
+//  Input:  raw bytes from the serial port (a file, a tty, or - for stdin),
+//          or the TX capture written by rv32sim -u
+//  Output: one line per SysTick_Handler report, plus its histogram
+//
+// Bytes that do not form a frame with a valid sum are skipped.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "BeepSynth.h"
+#include "Telemetry.h"
+
+#define HCLK              48000000
+
+static uint32_t ReadLE(const uint8_t* p, int length)
+{
+    uint32_t value = 0;
+    for(int i = length - 1; i >= 0; i --)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// One IsrStats field of a payload, wherever the struct puts it
+#define ISR_FIELD(payload, field) \
+    ReadLE((payload) + offsetof(IsrStats, field), sizeof(((const IsrStats*)0)->field))
+
+// Since the capture started, for alarms
+static uint64_t totalOverruns;
+static uint64_t totalMissed;
+static uint32_t lastRxOverruns;
+
+static void PrintIsr(const uint8_t* payload, uint32_t budget)
+{
+    uint32_t count = ISR_FIELD(payload, count);
+    uint32_t total = ISR_FIELD(payload, total);
+    uint32_t awake = ISR_FIELD(payload, mainAwake);
+    uint32_t missed = ISR_FIELD(payload, missed);
+    uint32_t rxOverruns = ISR_FIELD(payload, rxOverruns);
+    uint32_t min = ISR_FIELD(payload, min);
+    uint32_t max = ISR_FIELD(payload, max);
+    uint32_t overruns = ISR_FIELD(payload, overruns);
+    uint32_t worstLate = ISR_FIELD(payload, worstLate);
+    double mean = count ? (double)total / count : 0.0;
+
+    totalOverruns += overruns;
+    totalMissed += missed;
+    if(count == 0)
+    {
+        printf("isr: no ticks\n");
+        return;
+    }
+    printf("isr: %7u ticks  min %5u  mean %7.1f  max %5u  (max %5.1f%% of %u)\n",
+           count, min, mean, max, 100.0 * max / budget, budget);
+    printf("     main loop awake %5.1f%%\n", 100.0 * awake / count);
+    printf("     late by up to %u%s cycles, %u overruns, %u ticks missed (%llu overruns, %llu missed so far)\n",
+           worstLate, worstLate == UINT16_MAX ? "+" : "", overruns, missed,
+           (unsigned long long)totalOverruns, (unsigned long long)totalMissed);
+    printf("     receive ring overruns %u since boot%s\n", rxOverruns,
+           rxOverruns != lastRxOverruns ? ", MIDI bytes dropped" : "");
+    lastRxOverruns = rxOverruns;
+    printf("    ");
+    for(int i = 0; i < TELEMETRY_HISTOGRAM_BINS; i ++)
+    {
+        uint32_t bin = ReadLE(payload + offsetof(IsrStats, histogram) + i * sizeof(uint16_t), sizeof(uint16_t));
+        if(bin != 0)
+        {
+            printf(" %u%s:%u", i << TELEMETRY_HISTOGRAM_SHIFT,
+                   i == TELEMETRY_HISTOGRAM_BINS - 1 ? "+" : "", bin);
+        }
+    }
+    printf("\n");
+}
+
+static uint8_t frame[TELEMETRY_FRAME_SIZE(255)];
+static size_t length;
+static uint32_t budget;
+
+static void Feed(uint8_t c);
+
+// Drop the sync byte at the head and scan the bytes after it again
+static void Resync(void)
+{
+    uint8_t rest[sizeof(frame)];
+    size_t count = length - 1;
+    memcpy(rest, frame + 1, count);
+    length = 0;
+    for(size_t i = 0; i < count; i ++)
+    {
+        Feed(rest[i]);
+    }
+}
+
+// Collect one byte and print the frame it completes
+static void Feed(uint8_t c)
+{
+    if(length == 0 && c != TELEMETRY_SYNC)
+    {
+        return;
+    }
+    frame[length ++] = c;
+    if(length < TELEMETRY_HEADER_SIZE || length < TELEMETRY_FRAME_SIZE(frame[2]))
+    {
+        return;
+    }
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < length - 1; i ++)
+    {
+        sum += frame[i];
+    }
+    if(sum != frame[length - 1])
+    {
+        Resync();
+        return;
+    }
+    if(frame[1] == TELEMETRY_TYPE_ISR && frame[2] == sizeof(IsrStats))
+    {
+        PrintIsr(frame + TELEMETRY_HEADER_SIZE, budget);
+    }
+    length = 0;
+}
+
+static void Usage(void)
+{
+    fprintf(stderr, "usage: teledump [-b budget] capture\n"
+                    "  -b budget   cycles per output tick (default %d)\n",
+                    HCLK / OUTPUT_SAMPLING_FREQUENCY);
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* file;
+    int option;
+    int c;
+
+    budget = HCLK / OUTPUT_SAMPLING_FREQUENCY;
+    while((option = getopt(argc, argv, "b:")) != -1)
+    {
+        switch(option)
+        {
+        case 'b':
+            budget = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+    if(argc - optind != 1 || budget == 0)
+    {
+        Usage();
+        return 1;
+    }
+
+    if(strcmp(argv[optind], "-") == 0)
+    {
+        file = stdin;
+    }
+    else if((file = fopen(argv[optind], "rb")) == NULL)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    while((c = fgetc(file)) != EOF)
+    {
+        Feed((uint8_t)c);
+    }
+    // A bogus length at a false sync byte may hold back real frames
+    while(length > 0)
+    {
+        Resync();
+    }
+
+    if(file != stdin)
+    {
+        fclose(file);
+    }
+    return 0;
+}
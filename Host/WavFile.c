@@ -0,0 +1,54 @@
+#include "WavFile.h"
+
+static void WriteLE(FILE* file, uint32_t value, int length)
+{
+    for(int i = 0; i < length; i ++)
+    {
+        fputc((value >> (i * 8)) & 0xFF, file);
+    }
+}
+
+static void WriteHeader(WavFile* wav)
+{
+    fwrite("RIFF", 1, 4, wav->file);
+    WriteLE(wav->file, 36 + wav->count, 4);
+    fwrite("WAVEfmt ", 1, 8, wav->file);
+    WriteLE(wav->file, 16, 4);
+    WriteLE(wav->file, 1, 2);           // PCM
+    WriteLE(wav->file, 1, 2);           // mono
+    WriteLE(wav->file, wav->rate, 4);
+    WriteLE(wav->file, wav->rate, 4);   // byte rate
+    WriteLE(wav->file, 1, 2);           // block align
+    WriteLE(wav->file, 8, 2);           // bits per sample
+    fwrite("data", 1, 4, wav->file);
+    WriteLE(wav->file, wav->count, 4);
+}
+
+int WavOpen(WavFile* wav, const char* path, uint32_t rate)
+{
+    wav->file = fopen(path, "wb");
+    if(wav->file == NULL)
+    {
+        perror(path);
+        return 0;
+    }
+    wav->rate = rate;
+    wav->count = 0;
+    WriteHeader(wav);
+    return 1;
+}
+
+void WavWrite(WavFile* wav, uint8_t data)
+{
+    fputc(data, wav->file);
+    ++ wav->count;
+}
+
+// Patch the sizes into the header and close
+void WavClose(WavFile* wav)
+{
+    fseek(wav->file, 0, SEEK_SET);
+    WriteHeader(wav);
+    fclose(wav->file);
+    wav->file = NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef WAVFILE_H
+#define WAVFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// 8bit unsigned mono WAV, the same range as the 0-255 PWM duty
+typedef struct WavFile_
+{
+    FILE* file;
+    uint32_t rate;
+    uint32_t count;
+} WavFile;
+
+int WavOpen(WavFile* wav, const char* path, uint32_t rate);
+void WavWrite(WavFile* wav, uint8_t data);
+void WavClose(WavFile* wav);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef BEEPCONFIG_H
+#define BEEPCONFIG_H
+
+// Build configuration of the synth. Host/TableGen.c computes BeepTables.h
+// from it; after a change, both the host and the firmware build stop with
+// #error until make -C Host tables has been run.
+
+// Output rate at boot; BeepSynthSetSamplingFrequency changes it between
+// SAMPLING_FREQUENCY_MIN, where the top octave increment still fits in 32
+// bits, and SAMPLING_FREQUENCY_MAX, where one sample is 1500 cycles
+#define OUTPUT_SAMPLING_FREQUENCY 16000
+#define SAMPLING_FREQUENCY_MIN    8000
+#define SAMPLING_FREQUENCY_MAX    32000
+
+// Pitch of MIDI note 69 (A4) in mHz
+#define TUNING_A4_MILLIHERTZ      440000
+
+// Beep voices, at most 31, and drums sounding at once; each drum costs
+// about as much as a few beep voices
+#define CHANNEL_COUNT             20
+#define DRUM_COUNT                3
+
+// Mixer sum to PWM duty: sum / PSG_DEVIDE_FACTOR, linear up to
+// SOFT_CLIP_KNEE, then a soft knee approaching 255
+#define PSG_DEVIDE_FACTOR         9
+#define SOFT_CLIP_KNEE            192
+
+// Voice gain per MIDI channel volume 0-15 (CC 7 and 11 >> 3). Drum levels
+// always follow the logarithmic curve.
+#define VOLUME_CURVE_LINEAR       0   // 16 per step, 32 at 1 up to 255 at 15
+#define VOLUME_CURVE_LOG          1   // doubles every VOLUME_LOG_STEPS, 255 at 15
+#define VOICE_VOLUME_CURVE        VOLUME_CURVE_LINEAR
+#define VOLUME_LOG_STEPS          3   // about 2dB per step
+
+// Drum levels that keep a gain of their own instead of the curve's
+#define DRUM_VOLUME_OVERRIDES \
+    DRUM_VOLUME(8, 51)  /* the hand-made table the curve replaced */
+
+// Drum timing counts TIME_UNIT per second, whatever the output rate
+#define TIME_UNIT                 2000000
+
+// GM percussion notes DRUM_NOTE_FIRST to DRUM_NOTE_LAST played as
+// psgEffectDatas[effect]; notes not listed are ignored
+#define DRUM_NOTE_FIRST           35
+#define DRUM_NOTE_LAST            57
+#define DRUM_NOTE_MAP \
+    DRUM_NOTE(35, 0)    /* Acoustic Bass Drum: Bass Drum */ \
+    DRUM_NOTE(36, 0)    /* Bass Drum 1: Bass Drum */ \
+    DRUM_NOTE(37, 5)    /* Side Stick: Rim Shot */ \
+    DRUM_NOTE(38, 1)    /* Acoustic Snare: Snare Drum */ \
+    DRUM_NOTE(40, 6)    /* Electric Snare: Snare Drum 2 */ \
+    DRUM_NOTE(41, 2)    /* Low Floor Tom: Low Tom */ \
+    DRUM_NOTE(42, 7)    /* Closed Hi-Hat: Hi-Hat Close */ \
+    DRUM_NOTE(43, 4)    /* High Floor Tom: High Tom */ \
+    DRUM_NOTE(45, 2)    /* Low Tom: Low Tom */ \
+    DRUM_NOTE(46, 8)    /* Open Hi-Hat: Hi-Hat Open */ \
+    DRUM_NOTE(47, 3)    /* Low-Mid Tom: Middle Tom */ \
+    DRUM_NOTE(48, 3)    /* Hi-Mid Tom: Middle Tom */ \
+    DRUM_NOTE(49, 9)    /* Crash Cymbal 1: Crush Cymbal */ \
+    DRUM_NOTE(50, 4)    /* High Tom: High Tom */ \
+    DRUM_NOTE(51, 10)   /* Ride Cymbal 1: Ride Cymbal */ \
+    DRUM_NOTE(57, 9)    /* Crash Cymbal 2: Crush Cymbal */
+
+#endif
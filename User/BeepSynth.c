@@ -0,0 +1,672 @@
+#include "BeepSynth.h"
+#include "BeepTables.h"
+
+#define SOFT_CLIP_LENGTH (sizeof(softClip) / sizeof(softClip[0]))
+
+// GM percussion note to psgEffectDatas index + 1, 0 for none
+static const uint8_t drumNoteEffect[DRUM_NOTE_LAST - DRUM_NOTE_FIRST + 1] =
+{
+#define DRUM_NOTE(note, effect) [(note) - DRUM_NOTE_FIRST] = (effect) + 1,
+    DRUM_NOTE_MAP
+#undef DRUM_NOTE
+};
+
+// Beep
+BeepOscillators beep;
+BeepNotes beepNotes;
+uint8_t midi_ch_volume[16];
+uint8_t voiceHead = VOICE_NONE;
+uint32_t freeVoices;
+uint8_t voiceCount;
+uint8_t voiceLimit = CHANNEL_COUNT;
+static volatile uint32_t renderPeak;
+static volatile uint16_t renderTicks;
+uint32_t outputSamplingFrequency = OUTPUT_SAMPLING_FREQUENCY;
+uint32_t outputSamplePeriod;
+
+// toneIncrementReference[] rescaled to outputSamplingFrequency; the other
+// octaves are shifts of it
+static uint32_t toneIncrementTop[12];
+// Render cycles per sample for the governor at outputSamplingFrequency
+static uint16_t governorShedCycles;
+static uint16_t governorRestoreCycles;
+
+// Voices in the sounding list, which still holds a stopped voice until
+// the next sample unlinks it; owned by the output interrupt
+static uint32_t linkedVoices;
+
+// Sounding voices by (channel, note), chained through hash_next
+static uint8_t voiceHash[VOICE_HASH_SIZE];
+// Allocated voices linked through age_next from the oldest note on to the
+// newest, the main loop's own copy of the sounding order
+static uint8_t ageHead = VOICE_NONE;
+static uint8_t ageTail = VOICE_NONE;
+
+// toneIncrementTop is rescaled in 32 bits, from the remainder of a divide
+// by the new rate times OUTPUT_SAMPLING_FREQUENCY
+#if SAMPLING_FREQUENCY_MAX * OUTPUT_SAMPLING_FREQUENCY + SAMPLING_FREQUENCY_MAX / 2 > 0xFFFFFFFF
+#error "SAMPLING_FREQUENCY_MAX * OUTPUT_SAMPLING_FREQUENCY does not fit in 32 bits"
+#endif
+#if CHANNEL_COUNT > VOICE_NONE
+#error "voice links hold CHANNEL_COUNT and VOICE_NONE in 5 bits"
+#endif
+#define ALL_VOICES ((1UL << CHANNEL_COUNT) - 1)
+
+// Commands from the main loop, applied by BeepSynthGetData before it
+// renders the next sample. voiceQueueWrite only moves in the main loop and
+// voiceQueueRead only in the output interrupt, so neither side locks.
+#define VOICE_COMMAND_ON          0   // voice, note as tonePitch, gain
+#define VOICE_COMMAND_OFF         1   // voice
+#define VOICE_COMMAND_GAIN        2   // voice, gain
+#define VOICE_COMMAND_DRUM_PLAY   3   // note is the drum effect
+#define VOICE_COMMAND_DRUM_STOP   4
+#define VOICE_COMMAND_DRUM_VOLUME 5   // note is the volume
+
+typedef struct VoiceCommand_
+{
+    uint8_t command;
+    uint8_t voice;
+    uint8_t note;
+    uint8_t gain;
+} VoiceCommand;
+
+#if (VOICE_QUEUE_LENGTH & (VOICE_QUEUE_LENGTH - 1)) != 0 || VOICE_QUEUE_LENGTH > 128
+#error "VOICE_QUEUE_LENGTH must be a power of 2 up to 128"
+#endif
+static volatile VoiceCommand voiceQueue[VOICE_QUEUE_LENGTH];
+static volatile uint8_t voiceQueueWrite;
+static volatile uint8_t voiceQueueRead;
+
+// NoiseDrum
+DrumPool drums;
+
+// Start of the SysEx being received
+static uint8_t sysExData[4];
+static uint8_t sysExLength;
+
+// At boot, while nothing sounds and the queue is empty, so the output
+// interrupt may already be running
+void psg_reset(void)
+{
+    for(int i = 0; i < CHANNEL_COUNT; i ++)
+    {
+        beep.psg_osc_phase[i] = 0;
+        beep.psg_osc_increment[i] = 0;
+    }
+    voiceHead = VOICE_NONE;
+    linkedVoices = 0;
+    ageHead = VOICE_NONE;
+    ageTail = VOICE_NONE;
+    freeVoices = ALL_VOICES;
+    voiceCount = 0;
+    voiceLimit = CHANNEL_COUNT;
+    for(int i = 0; i < VOICE_HASH_SIZE; i ++)
+    {
+        voiceHash[i] = VOICE_NONE;
+    }
+    voiceQueueRead = voiceQueueWrite;
+}
+
+// ------------------------------------------------------------------
+// Output interrupt side: the oscillators and the sounding list
+// ------------------------------------------------------------------
+
+// Phase increment for a tonePitch, rounded
+static inline uint32_t toneIncrement(uint8_t pitch)
+{
+    uint32_t top = toneIncrementTop[pitch & 0x0F];
+    uint8_t octave = pitch >> 4;
+    uint8_t shift;
+    if(octave > TONE_TOP_OCTAVE)
+    {
+        // Notes 120-127 wrap, that is alias, at rates below their pitch
+        return top << (octave - TONE_TOP_OCTAVE);
+    }
+    shift = TONE_TOP_OCTAVE - octave;
+    return (top + ((1UL << shift) >> 1)) >> shift;
+}
+
+static inline void voiceStart(uint8_t i, uint8_t pitch, uint8_t gain)
+{
+    beep.psg_gain[i] = gain;
+    beep.psg_osc_increment[i] = toneIncrement(pitch);
+    // Start on the high half of the square
+    beep.psg_osc_phase[i] = 0x80000000;
+    if((linkedVoices & (1UL << i)) == 0)
+    {
+        // Push as the newest voice
+        linkedVoices |= 1UL << i;
+        beep.psg_next[i] = voiceHead;
+        voiceHead = i;
+    }
+}
+
+// Silent from the next sample on, which also unlinks it
+static inline void voiceStop(uint8_t i)
+{
+    beep.psg_osc_increment[i] = 0;
+}
+
+// Apply every queued command, at a sample boundary. Kept out of line, so
+// it stays in flash when BeepSynthGetData runs from RAM.
+static __attribute__((noinline)) void voiceQueueApply(void)
+{
+    uint8_t read = voiceQueueRead;
+    while(read != voiceQueueWrite)
+    {
+        volatile VoiceCommand* command = &voiceQueue[read & (VOICE_QUEUE_LENGTH - 1)];
+        switch(command->command)
+        {
+        case VOICE_COMMAND_ON:
+            voiceStart(command->voice, command->note, command->gain);
+            break;
+        case VOICE_COMMAND_OFF:
+            voiceStop(command->voice);
+            break;
+        case VOICE_COMMAND_GAIN:
+            beep.psg_gain[command->voice] = command->gain;
+            break;
+        case VOICE_COMMAND_DRUM_PLAY:
+            NoiseDrumPoolSetPlay(&drums, command->note);
+            break;
+        case VOICE_COMMAND_DRUM_STOP:
+            NoiseDrumPoolStop(&drums);
+            break;
+        case VOICE_COMMAND_DRUM_VOLUME:
+            NoiseDrumPoolSetVolume(&drums, command->note);
+            break;
+        }
+        ++ read;
+    }
+    voiceQueueRead = read;
+}
+
+// ------------------------------------------------------------------
+// Main loop side: voice allocation, never the oscillators themselves
+// ------------------------------------------------------------------
+
+static void voiceQueuePush(uint8_t command, uint8_t voice, uint8_t note, uint8_t gain)
+{
+    uint8_t write = voiceQueueWrite;
+    volatile VoiceCommand* entry = &voiceQueue[write & (VOICE_QUEUE_LENGTH - 1)];
+    while((uint8_t)(write - voiceQueueRead) >= VOICE_QUEUE_LENGTH)
+    {
+        BeepSynthWait();
+    }
+    entry->command = command;
+    entry->voice = voice;
+    entry->note = note;
+    entry->gain = gain;
+    // Publish only once the entry is complete
+    voiceQueueWrite = write + 1;
+}
+
+static inline uint8_t voiceHashIndex(uint8_t ch, uint8_t note)
+{
+    return (note + (ch << 3)) & (VOICE_HASH_SIZE - 1);
+}
+
+// Voice sounding this note on this channel, or VOICE_NONE
+static uint8_t voiceFind(uint8_t ch, uint8_t note)
+{
+    uint8_t i = voiceHash[voiceHashIndex(ch, note)];
+    while(i != VOICE_NONE && (beepNotes.psg_midi_inuse_ch[i] != ch || beepNotes.psg_midi_note[i] != note))
+    {
+        i = beepNotes.psg_link[i].hash_next;
+    }
+    return i;
+}
+
+static void voiceHashInsert(uint8_t i)
+{
+    uint8_t* bucket = &voiceHash[voiceHashIndex(beepNotes.psg_midi_inuse_ch[i], beepNotes.psg_midi_note[i])];
+    beepNotes.psg_link[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void voiceHashRemove(uint8_t i)
+{
+    uint8_t* bucket = &voiceHash[voiceHashIndex(beepNotes.psg_midi_inuse_ch[i], beepNotes.psg_midi_note[i])];
+    uint8_t prev = *bucket;
+    if(prev == i)
+    {
+        *bucket = beepNotes.psg_link[i].hash_next;
+        return;
+    }
+    while(beepNotes.psg_link[prev].hash_next != i)
+    {
+        prev = beepNotes.psg_link[prev].hash_next;
+    }
+    beepNotes.psg_link[prev].hash_next = beepNotes.psg_link[i].hash_next;
+}
+
+// MIDI note as octave << 4 | semitone, so the output interrupt needs no
+// division to find its increment
+static inline uint8_t tonePitch(uint8_t note)
+{
+    return (uint8_t)(((note / 12) << 4) | (note % 12));
+}
+
+static inline uint8_t voiceGain(uint8_t volume)
+{
+    return psg_volume[volume];
+}
+
+static inline uint8_t voiceInUse(uint8_t i)
+{
+    return (freeVoices & (1UL << i)) == 0;
+}
+
+static inline void noteon(uint8_t i, uint8_t ch, uint8_t note, uint8_t volume)
+{
+    beepNotes.psg_midi_inuse_ch[i] = ch;
+    beepNotes.psg_midi_note[i] = note;
+    // Newest note on
+    beepNotes.psg_link[i].age_next = VOICE_NONE;
+    beepNotes.psg_link[i].age_prev = ageTail;
+    if(ageTail == VOICE_NONE)
+    {
+        ageHead = i;
+    }
+    else
+    {
+        beepNotes.psg_link[ageTail].age_next = i;
+    }
+    ageTail = i;
+    voiceHashInsert(i);
+    freeVoices &= ~(1UL << i);
+    ++ voiceCount;
+    voiceQueuePush(VOICE_COMMAND_ON, i, tonePitch(note), voiceGain(volume));
+}
+
+static inline void noteoff(uint8_t i)
+{
+    if(voiceInUse(i))
+    {
+        uint8_t prev = beepNotes.psg_link[i].age_prev;
+        uint8_t next = beepNotes.psg_link[i].age_next;
+        if(prev == VOICE_NONE)
+        {
+            ageHead = next;
+        }
+        else
+        {
+            beepNotes.psg_link[prev].age_next = next;
+        }
+        if(next == VOICE_NONE)
+        {
+            ageTail = prev;
+        }
+        else
+        {
+            beepNotes.psg_link[next].age_prev = prev;
+        }
+        voiceHashRemove(i);
+        freeVoices |= 1UL << i;
+        -- voiceCount;
+        voiceQueuePush(VOICE_COMMAND_OFF, i, 0, 0);
+    }
+}
+
+#if VOICE_STEAL_POLICY == VOICE_STEAL_SAME_CHANNEL
+// Allocated voice with the earliest note on of channel ch, walking the age
+// list only as far as the first one
+static uint8_t voiceOldestOnChannel(uint8_t ch)
+{
+    uint8_t i = ageHead;
+    while(i != VOICE_NONE && beepNotes.psg_midi_inuse_ch[i] != ch)
+    {
+        i = beepNotes.psg_link[i].age_next;
+    }
+    return i;
+}
+#endif
+
+// Voice to steal when none is free, per VOICE_STEAL_POLICY
+static uint8_t voiceSteal(uint8_t ch)
+{
+#if VOICE_STEAL_POLICY == VOICE_STEAL_OLDEST
+    (void)ch;
+    return ageHead;
+#elif VOICE_STEAL_POLICY == VOICE_STEAL_LOWEST
+    // Oldest first, so the older voice goes first between equal notes
+    uint8_t lowest = ageHead;
+    (void)ch;
+    for(uint8_t i = ageHead; i != VOICE_NONE; i = beepNotes.psg_link[i].age_next)
+    {
+        if(beepNotes.psg_midi_note[i] < beepNotes.psg_midi_note[lowest])
+        {
+            lowest = i;
+        }
+    }
+    return lowest;
+#elif VOICE_STEAL_POLICY == VOICE_STEAL_SAME_CHANNEL
+    uint8_t i = voiceOldestOnChannel(ch);
+    return i != VOICE_NONE ? i : ageHead;
+#else
+    (void)ch;
+    return VOICE_NONE;
+#endif
+}
+
+// Free voice with the lowest index, else a stolen one already silenced
+static uint8_t voiceAllocate(uint8_t ch)
+{
+    uint8_t i;
+    if(freeVoices != 0 && voiceCount < voiceLimit)
+    {
+        return __builtin_ctz(freeVoices);
+    }
+    i = voiceSteal(ch);
+    if(i != VOICE_NONE)
+    {
+        noteoff(i);
+    }
+    return i;
+}
+
+// Silence every voice of a MIDI channel
+static void channelNotesOff(uint8_t ch)
+{
+    for(uint8_t i = 0; i < CHANNEL_COUNT; i ++)
+    {
+        if(voiceInUse(i) && (beepNotes.psg_midi_inuse_ch[i] == ch))
+        {
+            noteoff(i);
+        }
+    }
+}
+
+// Silence every voice and drum, for System Reset and GM System On
+static void allSoundOff(void)
+{
+    for(uint8_t i = 0; i < CHANNEL_COUNT; i ++)
+    {
+        noteoff(i);
+    }
+    voiceQueuePush(VOICE_COMMAND_DRUM_STOP, 0, 0, 0);
+}
+
+void BeepSynthInitialize(void)
+{
+    NoiseDrumPoolInitialize(&drums);
+    psg_reset();
+    BeepSynthSetSamplingFrequency(outputSamplingFrequency);
+}
+
+// Main loop: derive everything that depends on the output rate. Sounding
+// voices keep the increments of the old rate, so every note is released
+// first. The caller reprograms the timer that paces BeepSynthGetData.
+void BeepSynthSetSamplingFrequency(uint32_t frequency)
+{
+    uint32_t budget = (SystemCoreClock + frequency / 2) / frequency;
+    allSoundOff();
+    outputSamplingFrequency = frequency;
+    outputSamplePeriod = budget;
+    for(int i = 0; i < 12; i ++)
+    {
+        // reference * OUTPUT_SAMPLING_FREQUENCY / frequency, rounded, in 32
+        // bits: split at a multiple of frequency, so neither product
+        // overflows and libgcc's 64-bit routines stay out of the image
+        uint32_t quotient = toneIncrementReference[i] / frequency;
+        uint32_t remainder = toneIncrementReference[i] % frequency;
+        toneIncrementTop[i] = quotient * OUTPUT_SAMPLING_FREQUENCY
+                            + (remainder * OUTPUT_SAMPLING_FREQUENCY + frequency / 2) / frequency;
+    }
+    NoiseDrumPoolSetSamplingFrequency(&drums, frequency);
+    governorShedCycles = budget * 9 / 10;
+    governorRestoreCycles = budget * 7 / 10;
+    // The window so far was measured against the old budget
+    renderPeak = 0;
+    renderTicks = 0;
+}
+
+// Compute the next PWM duty (0-255) for the output compare register.
+// The voice loop is the hottest code in the firmware, so it runs from RAM.
+RAMFUNC uint16_t BeepSynthGetData(void)
+{
+    uint16_t master_volume;
+    uint16_t output;
+    uint8_t* link;
+    uint8_t i;
+    if(voiceQueueRead != voiceQueueWrite)
+    {
+        voiceQueueApply();
+    }
+// Run Oscillator and Mixer
+    master_volume = 0;
+    link = &voiceHead;
+    while((i = *link) != VOICE_NONE)
+    {
+        uint32_t increment = beep.psg_osc_increment[i];
+        uint32_t phase;
+        if(increment == 0)
+        {
+            // Stopped since the last sample; the list is singly linked, so
+            // it is unlinked here, where the voice before it is known
+            *link = beep.psg_next[i];
+            linkedVoices &= ~(1UL << i);
+            continue;
+        }
+        phase = beep.psg_osc_phase[i] + increment;
+        beep.psg_osc_phase[i] = phase;
+        if(phase >> 31)
+        {
+            master_volume += beep.psg_gain[i];
+        }
+        link = &beep.psg_next[i];
+    }
+    master_volume += NoiseDrumPoolGetData(&drums);
+    if(master_volume < SOFT_CLIP_LINEAR)
+    {
+        // master_volume / PSG_DEVIDE_FACTOR, without the libgcc divide
+        output = (master_volume * SOFT_CLIP_RECIPROCAL) >> SOFT_CLIP_RECIPROCAL_SHIFT;
+        if(output * PSG_DEVIDE_FACTOR > master_volume)
+        {
+            -- output;
+        }
+        return output;
+    }
+    output = (master_volume - SOFT_CLIP_LINEAR) >> SOFT_CLIP_SHIFT;
+    if(output >= SOFT_CLIP_LENGTH)
+    {
+        output = SOFT_CLIP_LENGTH - 1;
+    }
+    return softClip[output];
+}
+
+// renderTicks stops at a full window, so a main loop that sleeps through
+// many windows still finds one due. Not RAMFUNC, like ProfilerRecord.
+void BeepSynthRenderCycles(uint32_t cycles, uint8_t samples)
+{
+    if(cycles > renderPeak)
+    {
+        renderPeak = cycles;
+    }
+    if(renderTicks < GOVERNOR_WINDOW)
+    {
+        renderTicks += samples;
+    }
+}
+
+// The last window ran over governorShedCycles, so BeepSynthGovern
+// should run without waiting for the next MIDI byte
+uint8_t BeepSynthGovernPending(void)
+{
+    return renderTicks >= GOVERNOR_WINDOW && renderPeak > governorShedCycles;
+}
+
+// Main loop: once per GOVERNOR_WINDOW samples, shed the oldest voice if
+// the slowest sample came close to the budget, or allow one more voice if
+// the limit is what holds the count down and there is room
+void BeepSynthGovern(void)
+{
+    uint32_t peak;
+    if(renderTicks < GOVERNOR_WINDOW)
+    {
+        return;
+    }
+    peak = renderPeak;
+    renderPeak = 0;
+    renderTicks = 0;
+    if(peak > governorShedCycles)
+    {
+        if(voiceLimit > voiceCount)
+        {
+            voiceLimit = voiceCount;
+        }
+        if(voiceLimit > GOVERNOR_MIN_VOICES)
+        {
+            -- voiceLimit;
+        }
+        else
+        {
+            voiceLimit = GOVERNOR_MIN_VOICES;
+        }
+        while(voiceCount > voiceLimit)
+        {
+            noteoff(ageHead);
+        }
+    }
+    else if(peak < governorRestoreCycles && voiceCount >= voiceLimit && voiceLimit < CHANNEL_COUNT)
+    {
+        ++ voiceLimit;
+    }
+}
+
+// Handle one complete MIDI message, as assembled by MidiParser.
+// Unused data bytes are 0.
+void BeepSynthMessage(uint8_t midicmd, uint8_t data1, uint8_t data2)
+{
+    uint8_t midicc1, midicc2, midinote, midivel;
+    uint8_t slot;
+    uint8_t midich = midicmd&0xf;
+    switch(midicmd & 0xF0)
+    {
+    case 0x80: // Note off
+        midinote = data1;
+        midivel = data2;
+        slot = voiceFind(midich, midinote);
+        if(slot != VOICE_NONE)
+        {
+            noteoff(slot);
+        }
+        break;
+    case 0x90: // Note on
+        midinote = data1;
+        midivel = data2;
+        if(midich != 9)
+        {
+            if(midivel != 0)
+            {
+                // check note is already on
+                if(voiceFind(midich, midinote) == VOICE_NONE)
+                {
+                    uint8_t i = voiceAllocate(midich);
+                    if(i != VOICE_NONE)
+                    {
+                        noteon(i, midich, midinote, midi_ch_volume[midich]);
+                    }
+                }
+            } else {
+                slot = voiceFind(midich, midinote);
+                if(slot != VOICE_NONE)
+                {
+                    noteoff(slot);
+                }
+            }
+        }
+        else
+        {
+            if((DRUM_NOTE_FIRST <= midinote) && (midinote <= DRUM_NOTE_LAST))
+            {
+                uint8_t effect = drumNoteEffect[midinote - DRUM_NOTE_FIRST];
+                if(effect != 0)
+                {
+                    voiceQueuePush(VOICE_COMMAND_DRUM_PLAY, 0, effect - 1, 0);
+                }
+            }
+        }
+        break;
+    case 0xB0:
+        // Channel control
+        midicc1 = data1;
+        switch(midicc1)
+        {
+        case 7:
+        case 11: // Expression
+            midicc2 = data2;
+            midi_ch_volume[midich] = (midicc2 >> 3);
+            if(midich == 9)
+            {
+                voiceQueuePush(VOICE_COMMAND_DRUM_VOLUME, 0, midi_ch_volume[midich], 0);
+            }
+            for(uint8_t i = 0; i < CHANNEL_COUNT; i ++)
+            {
+                if(voiceInUse(i) && (beepNotes.psg_midi_inuse_ch[i] == midich))
+                {
+                    voiceQueuePush(VOICE_COMMAND_GAIN, i, 0, voiceGain(midi_ch_volume[midich]));
+                }
+            }
+            break;
+
+        case 0: //Bank select
+        case 120:// All note off
+        case 121:// All reset
+        case 123:
+        case 124:
+        case 125:
+        case 126:
+        case 127:
+            channelNotesOff(midich);
+            break;
+        default:
+            break;
+        }
+        break;
+    case 0xC0:
+        // Program change
+        channelNotesOff(midich);
+        break;
+    case 0xF0:
+        // System messages; real-time clock, start/stop and active sensing
+        // need nothing here
+        if(midicmd == 0xFF)
+        {
+            allSoundOff();
+        }
+        break;
+    default: // Skip
+        break;
+    }
+}
+
+// SysEx handler for MidiParser. Reacts to GM System On and GM2 System On,
+// F0 7E <device> 09 01|03 F7, and ignores everything else.
+void BeepSynthSysEx(uint8_t event, uint8_t data)
+{
+    switch(event)
+    {
+    case MIDI_SYSEX_START:
+        sysExLength = 0;
+        break;
+    case MIDI_SYSEX_DATA:
+        if(sysExLength < sizeof(sysExData))
+        {
+            sysExData[sysExLength] = data;
+        }
+        if(sysExLength < UINT8_MAX)
+        {
+            ++ sysExLength;
+        }
+        break;
+    case MIDI_SYSEX_END:
+        if((sysExLength == 4) && (sysExData[0] == 0x7E) && (sysExData[2] == 0x09) && ((sysExData[3] == 0x01) || (sysExData[3] == 0x03)))
+        {
+            allSoundOff();
+        }
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef BEEPSYNTH_H
+#define BEEPSYNTH_H
+
+#include <stdint.h>
+#include "BeepConfig.h"
+#include "NoiseDrum.h"
+#include "MidiParser.h"
+#include "RamFunc.h"
+
+// Output rate, tuning, voice count and mixer curves are in BeepConfig.h
+
+// Voice taken for a note on when every voice is sounding
+#define VOICE_STEAL_NONE          0   // drop the new note
+#define VOICE_STEAL_OLDEST        1   // the voice started first
+#define VOICE_STEAL_LOWEST        2   // the voice playing the lowest note
+#define VOICE_STEAL_SAME_CHANNEL  3   // the oldest voice of the same MIDI channel, else the oldest
+#define VOICE_STEAL_POLICY        VOICE_STEAL_OLDEST
+
+// No voice, in 5 bits like the links between voices
+#define VOICE_NONE                0x1F
+
+// Buckets of the (channel, note) to voice lookup, a power of 2
+#define VOICE_HASH_SIZE           32
+
+// Polyphony governor. The output interrupt reports the cycles each sample
+// took; when the worst sample of a window comes above 9/10 of the
+// budget of one sample period, the oldest note is released and the voice
+// limit lowered, and when it is back under 7/10 the limit goes back up.
+#define POLYPHONY_GOVERNOR        1
+#define GOVERNOR_WINDOW           64  // samples per decision, 4ms at 16kHz
+#define GOVERNOR_MIN_VOICES       4
+
+// Voice commands the main loop can queue ahead of the output interrupt,
+// a power of 2
+#define VOICE_QUEUE_LENGTH        16
+
+// Voice state as parallel arrays indexed by voice, so no field pads
+// another. RAM per voice: 10 bytes here and 4 in BeepNotes.
+//
+// Oscillators and the sounding list, owned by the output interrupt. The
+// main loop changes them only through the voice command queue. A voice
+// sounds while its increment is not 0; a stopped voice stays in the list
+// until the next sample unlinks it.
+typedef struct BeepOscillators_
+{
+    uint32_t psg_osc_phase[CHANNEL_COUNT];      // square output is the top bit
+    uint32_t psg_osc_increment[CHANNEL_COUNT];
+    uint8_t psg_gain[CHANNEL_COUNT];            // added to the mix while the output is high
+    uint8_t psg_next[CHANNEL_COUNT];            // sounding voices, newest first
+} BeepOscillators;
+
+// Links of one voice to others, packed in 16 bits
+typedef struct BeepLinks_
+{
+    uint16_t hash_next : 5;                     // next voice in the same voiceHash bucket
+    uint16_t age_next : 5;                      // allocated voices, oldest note on first
+    uint16_t age_prev : 5;
+} BeepLinks;
+
+// MIDI bookkeeping, owned by the main loop. A voice is allocated while its
+// bit in freeVoices is clear; the fields are stale otherwise.
+typedef struct BeepNotes_
+{
+    uint8_t psg_midi_inuse_ch[CHANNEL_COUNT];
+    uint8_t psg_midi_note[CHANNEL_COUNT];
+    BeepLinks psg_link[CHANNEL_COUNT];
+} BeepNotes;
+
+// Beep
+extern BeepOscillators beep;
+extern BeepNotes beepNotes;
+extern uint8_t midi_ch_volume[16];
+
+// Sounding voices linked from voiceHead, as the output interrupt sees
+// them, and a bitmask of the voices the main loop has not allocated
+extern uint8_t voiceHead;
+extern uint32_t freeVoices;
+// Voices allocated now, and at most, as set by the governor
+extern uint8_t voiceCount;
+extern uint8_t voiceLimit;
+// Output samples per second, as BeepSynthGetData is being paced, and the
+// HCLK cycles between two samples that the output timer counts. The period
+// is rounded, so the rate, and with it every pitch, is off by at most half
+// a cycle per sample: 60ppm at 11025Hz and 22050Hz, a tenth of a cent.
+extern uint32_t outputSamplingFrequency;
+extern uint32_t outputSamplePeriod;
+
+// NoiseDrum
+extern DrumPool drums;
+
+void psg_reset(void);
+void BeepSynthInitialize(void);
+void BeepSynthSetSamplingFrequency(uint32_t frequency);
+uint16_t BeepSynthGetData(void) RAMFUNC;
+void BeepSynthMessage(uint8_t midicmd, uint8_t data1, uint8_t data2);
+void BeepSynthSysEx(uint8_t event, uint8_t data);
+void BeepSynthGovern(void);
+uint8_t BeepSynthGovernPending(void);
+
+// Output interrupt: the cycles rendering took, per sample, over samples
+void BeepSynthRenderCycles(uint32_t cycles, uint8_t samples);
+
+// Provided by the program: called from BeepSynthMessage while the voice
+// command queue is full, and returns once BeepSynthGetData may have run
+void BeepSynthWait(void);
+// Provided by the program: HCLK, which the render cycles are counted in
+// (system_ch32v00x.c on the chip)
+extern uint32_t SystemCoreClock;
+
+#endif
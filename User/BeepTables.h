@@ -0,0 +1,88 @@
+// Generated by Host/TableGen.c from BeepConfig.h, do not edit.
+// make -C Host tables writes it again.
+#ifndef BEEPTABLES_H
+#define BEEPTABLES_H
+
+#include <stdint.h>
+#include "BeepConfig.h"
+
+#if OUTPUT_SAMPLING_FREQUENCY != 16000 || TUNING_A4_MILLIHERTZ != 440000 || PSG_DEVIDE_FACTOR != 9 \
+    || SOFT_CLIP_KNEE != 192 || VOICE_VOLUME_CURVE != 0 || VOLUME_LOG_STEPS != 3 \
+    || CHANNEL_COUNT != 20 || DRUM_COUNT != 3
+#error "BeepTables.h is out of date, run make -C Host tables"
+#endif
+
+// DRUM_VOLUME_OVERRIDES the tables were made with, level and value
+#define TABLE_DRUM_VOLUME_OVERRIDE_COUNT 1
+#define TABLE_DRUM_VOLUME_8 51
+#define DRUM_VOLUME(level, value) + 1
+#if (0 DRUM_VOLUME_OVERRIDES) != TABLE_DRUM_VOLUME_OVERRIDE_COUNT
+#error "BeepTables.h is out of date, run make -C Host tables"
+#endif
+#undef DRUM_VOLUME
+#define DRUM_VOLUME(level, value) \
+    _Static_assert(TABLE_DRUM_VOLUME_##level == (value), "BeepTables.h is out of date, run make -C Host tables");
+DRUM_VOLUME_OVERRIDES
+#undef DRUM_VOLUME
+
+// Phase increment per output sample for notes 108-119 at
+// OUTPUT_SAMPLING_FREQUENCY: round(A4 * 2^((note - 69) / 12) * 2^32 / rate)
+#define TONE_TOP_OCTAVE 9
+static const uint32_t toneIncrementReference[12] =
+{
+    1123673247, 1190490335, 1261280574, 1336280220, 1415739577, 1499923833,
+    1589113945, 1683607578, 1783720094, 1889785610, 2002158110, 2121212627
+};
+
+// Voice gain per MIDI channel volume
+static const uint8_t psg_volume[16] =
+{
+    0, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 255
+};
+
+// Drum level to gain, 256 * 2^((level - 15) / 3) rounded down, but for
+// DRUM_VOLUME_OVERRIDES
+static const uint8_t volumeTable[17] =
+{
+    0, 10, 12, 16, 20, 25, 32, 40, 51, 64, 80, 101, 128, 161, 203, 255, 255
+};
+
+// Mixer sum to PWM duty. Below SOFT_CLIP_LINEAR it is sum / 9, from
+// (sum * SOFT_CLIP_RECIPROCAL) >> SOFT_CLIP_RECIPROCAL_SHIFT less one if that
+// is too high. From there softClip is indexed by
+// (sum - SOFT_CLIP_LINEAR) >> SOFT_CLIP_SHIFT, rounded with x taken at the
+// middle of each index:
+//   x = (1728 + index * 8 + 3.5) / 9; y = 192 + 63 * (1 - exp(-(x - 192) / 63))
+// The table ends at the highest sum, 5865 for 20 voices and 3 drums, or at
+// the first 255; sums past the end take the last entry.
+#define SOFT_CLIP_LINEAR 1728
+#define SOFT_CLIP_RECIPROCAL 57
+#define SOFT_CLIP_RECIPROCAL_SHIFT 9
+#define SOFT_CLIP_SHIFT 3
+static const uint8_t softClip[344] =
+{
+    192, 193, 194, 195, 196, 197, 197, 198, 199, 200, 201, 201, 202, 203, 204, 204,
+    205, 206, 206, 207, 208, 208, 209, 210, 210, 211, 212, 212, 213, 213, 214, 215,
+    215, 216, 216, 217, 217, 218, 218, 219, 219, 220, 220, 221, 221, 222, 222, 223,
+    223, 224, 224, 225, 225, 225, 226, 226, 227, 227, 227, 228, 228, 229, 229, 229,
+    230, 230, 230, 231, 231, 231, 232, 232, 232, 233, 233, 233, 234, 234, 234, 234,
+    235, 235, 235, 236, 236, 236, 236, 237, 237, 237, 237, 238, 238, 238, 238, 239,
+    239, 239, 239, 240, 240, 240, 240, 240, 241, 241, 241, 241, 241, 242, 242, 242,
+    242, 242, 242, 243, 243, 243, 243, 243, 243, 244, 244, 244, 244, 244, 244, 245,
+    245, 245, 245, 245, 245, 245, 246, 246, 246, 246, 246, 246, 246, 246, 247, 247,
+    247, 247, 247, 247, 247, 247, 247, 248, 248, 248, 248, 248, 248, 248, 248, 248,
+    248, 249, 249, 249, 249, 249, 249, 249, 249, 249, 249, 249, 249, 250, 250, 250,
+    250, 250, 250, 250, 250, 250, 250, 250, 250, 250, 250, 251, 251, 251, 251, 251,
+    251, 251, 251, 251, 251, 251, 251, 251, 251, 251, 251, 251, 251, 252, 252, 252,
+    252, 252, 252, 252, 252, 252, 252, 252, 252, 252, 252, 252, 252, 252, 252, 252,
+    252, 252, 252, 252, 252, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253,
+    253, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253, 253,
+    253, 253, 253, 253, 253, 253, 253, 253, 253, 254, 254, 254, 254, 254, 254, 254,
+    254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254,
+    254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254,
+    254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254,
+    254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254, 254,
+    254, 254, 254, 254, 254, 254, 254, 255
+};
+
+#endif
@@ -0,0 +1,178 @@
+// Block rendering with DMA-fed PWM
+//
+// TIM2 overflows at outputSamplingFrequency and each update event has
+// DMA1_Channel2 write one value of outputBuffer into TIM1->CH4CVR. The
+// buffer is circular with two halves: the half-transfer interrupt refills
+// the first half while the second is played, and transfer-complete the
+// second. One interrupt per OUTPUT_BLOCK_LENGTH samples replaces the
+// SysTick interrupt per sample.
+//
+// TIM1_UP shares DMA1_Channel5 with USART1_RX, so TIM2 paces the transfer.
+
+#include "BlockOutput.h"
+#include "Profiler.h"
+
+// Nothing here is compiled in the default SysTick build: the handler would
+// replace the weak vector and the buffer would take RAM
+#if BLOCK_OUTPUT
+
+static uint16_t outputBuffer[OUTPUT_BLOCK_LENGTH * 2];
+#define OUTPUT_BUFFER_LENGTH (OUTPUT_BLOCK_LENGTH * 2)
+#if (OUTPUT_BUFFER_LENGTH & (OUTPUT_BUFFER_LENGTH - 1)) != 0
+#error "OUTPUT_BLOCK_LENGTH must be a power of 2"
+#endif
+#if ISR_PROFILE
+// Cycles DMA takes to go round outputBuffer, and the SysTick->CNT at which
+// each half is next due to finish. The DMA position alone cannot tell a
+// stall of a whole buffer or more from none, so lateness comes from this
+// schedule. After a rate change each half starts it again on its next
+// refill, which counts as on time.
+static uint32_t bufferPeriod;
+static uint32_t blockDue[2];
+static volatile uint8_t blockResync[2];
+#endif
+
+// After SetupPWMOut and BeepSynthInitialize; replaces SetupSysTick
+void SetupBlockOutput(void)
+{
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseInitStructure = {0};
+    DMA_InitTypeDef DMA_InitStructure = {0};
+    NVIC_InitTypeDef NVIC_InitStructure = {0};
+
+    // SysTick only counts cycles for the profiler
+    SysTick->CTLR = 0;
+    SysTick->CMP = UINT32_MAX;
+    SysTick->CNT = 0;
+    SysTick->CTLR = 0x5;
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    DMA_DeInit(DMA1_Channel2);
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (u32)&TIM1->CH4CVR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (u32)outputBuffer;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+    DMA_InitStructure.DMA_BufferSize = OUTPUT_BLOCK_LENGTH * 2;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel2, &DMA_InitStructure);
+    DMA_ITConfig(DMA1_Channel2, DMA_IT_HT | DMA_IT_TC, ENABLE);
+    DMA_Cmd(DMA1_Channel2, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel2_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
+    TIM_TimeBaseInitStructure.TIM_Period = outputSamplePeriod - 1;
+    TIM_TimeBaseInitStructure.TIM_Prescaler = 0;
+    TIM_TimeBaseInitStructure.TIM_ClockDivision = TIM_CKD_DIV1;
+    TIM_TimeBaseInitStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseInit(TIM2, &TIM_TimeBaseInitStructure);
+    // A new period takes effect at the next update, never mid-count
+    TIM_ARRPreloadConfig(TIM2, ENABLE);
+    TIM_DMACmd(TIM2, TIM_DMA_Update, ENABLE);
+#if ISR_PROFILE
+    // DMA sends the first sample at the first update
+    bufferPeriod = outputSamplePeriod * OUTPUT_BUFFER_LENGTH;
+    blockDue[0] = SysTick->CNT + bufferPeriod / 2;
+    blockDue[1] = blockDue[0] + bufferPeriod / 2;
+#endif
+    TIM_Cmd(TIM2, ENABLE);
+}
+
+// After BeepSynthSetSamplingFrequency
+void SetBlockOutputPeriod(void)
+{
+#if ISR_PROFILE
+    __disable_irq();
+    bufferPeriod = outputSamplePeriod * OUTPUT_BUFFER_LENGTH;
+    blockResync[0] = 1;
+    blockResync[1] = 1;
+    __enable_irq();
+#endif
+    TIM_SetAutoreload(TIM2, outputSamplePeriod - 1);
+}
+
+void DMA1_Channel2_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast"))) RAMFUNC;
+
+void DMA1_Channel2_IRQHandler(void)
+{
+    uint16_t* block;
+#if ISR_PROFILE || POLYPHONY_GOVERNOR
+    uint32_t enter = SysTick->CNT;
+#endif
+#if ISR_PROFILE
+    // Samples DMA has sent since the half ended, less whole laps; from
+    // OUTPUT_BLOCK_LENGTH on it is already sending stale samples from the
+    // half to refill
+    uint32_t late = OUTPUT_BUFFER_LENGTH - DMA_GetCurrDataCounter(DMA1_Channel2);
+    uint32_t lateCycles;
+    uint32_t behind;
+    uint32_t missed = 0;
+    uint8_t half;
+#endif
+    // Refill the half DMA has just finished with
+    if(DMA_GetITStatus(DMA1_IT_HT2))
+    {
+        DMA_ClearITPendingBit(DMA1_IT_HT2);
+        block = &outputBuffer[0];
+#if ISR_PROFILE
+        late -= OUTPUT_BLOCK_LENGTH;
+        half = 0;
+#endif
+    }
+    else
+    {
+        DMA_ClearITPendingBit(DMA1_IT_TC2);
+        block = &outputBuffer[OUTPUT_BLOCK_LENGTH];
+#if ISR_PROFILE
+        half = 1;
+#endif
+    }
+#if ISR_PROFILE
+    if(blockResync[half])
+    {
+        blockResync[half] = 0;
+        blockDue[half] = enter;
+    }
+    // Cycles since the half finished, by the schedule
+    lateCycles = enter - blockDue[half];
+    if((int32_t)lateCycles < 0)
+    {
+        lateCycles = 0;
+    }
+    // Each time DMA went all the way round, the half was played again as
+    // it was; its interrupts in between merged into this one
+    for(behind = lateCycles; behind >= bufferPeriod; behind -= bufferPeriod)
+    {
+        blockDue[half] += bufferPeriod;
+        missed += OUTPUT_BLOCK_LENGTH;
+    }
+    blockDue[half] += bufferPeriod;
+    late &= OUTPUT_BUFFER_LENGTH - 1;
+    if(late >= OUTPUT_BLOCK_LENGTH)
+    {
+        missed += late - OUTPUT_BLOCK_LENGTH + 1;
+    }
+    ProfilerLate(lateCycles, missed);
+#endif
+    for(int i = 0; i < OUTPUT_BLOCK_LENGTH; i ++)
+    {
+        block[i] = BeepSynthGetData();
+    }
+#if ISR_PROFILE
+    // Cycles per sample, comparable with the SysTick mode
+    ProfilerRecord(0, (SysTick->CNT - enter) / OUTPUT_BLOCK_LENGTH);
+#endif
+#if POLYPHONY_GOVERNOR
+    BeepSynthRenderCycles((SysTick->CNT - enter) / OUTPUT_BLOCK_LENGTH, OUTPUT_BLOCK_LENGTH);
+#endif
+}
+
+#endif
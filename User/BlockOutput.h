@@ -0,0 +1,18 @@
+#ifndef BLOCKOUTPUT_H
+#define BLOCKOUTPUT_H
+
+#include "debug.h"
+#include "BeepSynth.h"
+
+// 0: SysTick_Handler writes TIM1->CH4CVR and renders one sample per tick
+// 1: TIM2 update requests DMA1_Channel2 to copy the next duty into
+//    TIM1->CH4CVR; the channel's half/complete interrupt renders a block
+#define BLOCK_OUTPUT              0
+
+// Samples per half of the double buffer (2ms at 16kHz)
+#define OUTPUT_BLOCK_LENGTH       32
+
+void SetupBlockOutput(void);
+void SetBlockOutputPeriod(void);
+
+#endif
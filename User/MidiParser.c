@@ -0,0 +1,126 @@
+#include <stddef.h>
+#include "MidiParser.h"
+
+// Data bytes of the system common messages 0xF0-0xF7.
+// 0xF0 and 0xF7 frame SysEx, 0xF4/0xF5 are undefined.
+static const uint8_t systemCommonLength[] =
+{
+    0, 1, 2, 1, 0, 0, 0, 0
+};
+
+static uint8_t MidiParserComplete(MidiParser* parser, uint8_t status)
+{
+    parser->message[0] = status;
+    parser->message[1] = parser->length > 0 ? parser->data[0] : 0;
+    parser->message[2] = parser->length > 1 ? parser->data[1] : 0;
+    parser->count = 0;
+    return 1;
+}
+
+static void MidiParserSysEx(MidiParser* parser, uint8_t event, uint8_t data)
+{
+    if(parser->sysEx != NULL)
+    {
+        parser->sysEx(event, data);
+    }
+}
+
+void MidiParserInitialize(MidiParser* parser, MidiSysExHandler sysEx)
+{
+    parser->status = 0;
+    parser->length = 0;
+    parser->count = 0;
+    parser->sysEx = sysEx;
+}
+
+// Forget the message in progress, e.g. after input bytes were lost.
+// The next status byte starts over.
+void MidiParserReset(MidiParser* parser)
+{
+    if(parser->status == 0xF0)
+    {
+        MidiParserSysEx(parser, MIDI_SYSEX_ABORT, 0);
+    }
+    parser->status = 0;
+    parser->count = 0;
+}
+
+// Feed one received byte. Returns 1 when it completes a message, which is
+// then in parser->message.
+//  - channel messages set the running status; further data bytes repeat it
+//  - system common messages cancel the running status
+//  - system real-time bytes are a message of their own and may arrive
+//    anywhere, even between the data bytes of another message or in SysEx
+//  - SysEx bytes go to parser->sysEx until 0xF7 or any other status byte
+//  - data bytes with no status are dropped
+uint8_t MidiParserPush(MidiParser* parser, uint8_t data)
+{
+    if(data >= 0xF8)
+    {
+        parser->message[0] = data;
+        parser->message[1] = 0;
+        parser->message[2] = 0;
+        return 1;
+    }
+    if(parser->status == 0xF0)
+    {
+        if(data < 0x80)
+        {
+            MidiParserSysEx(parser, MIDI_SYSEX_DATA, data);
+            return 0;
+        }
+        parser->status = 0;
+        if(data == 0xF7)
+        {
+            MidiParserSysEx(parser, MIDI_SYSEX_END, data);
+            return 0;
+        }
+        MidiParserSysEx(parser, MIDI_SYSEX_ABORT, data);
+    }
+    if(data >= 0xF0)
+    {
+        parser->status = 0;
+        parser->count = 0;
+        parser->length = systemCommonLength[data & 0x07];
+        if(data == 0xF0)
+        {
+            parser->status = data;
+            MidiParserSysEx(parser, MIDI_SYSEX_START, data);
+            return 0;
+        }
+        if(data == 0xF7)
+        {
+            // End of SysEx that was never started
+            return 0;
+        }
+        if(parser->length == 0)
+        {
+            return MidiParserComplete(parser, data);
+        }
+        // Collect its data bytes once, the status is cleared when complete
+        parser->status = data;
+        return 0;
+    }
+    if(data >= 0x80)
+    {
+        parser->status = data;
+        parser->length = ((data & 0xE0) == 0xC0) ? 1 : 2;
+        parser->count = 0;
+        return 0;
+    }
+    if(parser->status == 0)
+    {
+        return 0;
+    }
+    parser->data[parser->count ++] = data;
+    if(parser->count < parser->length)
+    {
+        return 0;
+    }
+    data = parser->status;
+    if(data >= 0xF0)
+    {
+        parser->status = 0;
+    }
+    return MidiParserComplete(parser, data);
+}
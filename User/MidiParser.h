@@ -0,0 +1,29 @@
+#ifndef MIDIPARSER_H
+#define MIDIPARSER_H
+
+#include <stdint.h>
+
+// SysEx is passed on a byte at a time as it arrives
+#define MIDI_SYSEX_START    0   // 0xF0
+#define MIDI_SYSEX_DATA     1
+#define MIDI_SYSEX_END      2   // 0xF7
+#define MIDI_SYSEX_ABORT    3   // another status byte, or lost input, cut it short
+
+typedef void (*MidiSysExHandler)(uint8_t event, uint8_t data);
+
+// MIDI byte stream to messages, one byte at a time, with running status
+typedef struct MidiParser_
+{
+    uint8_t status;         // running status, 0 while data bytes are ignored
+    uint8_t length;         // data bytes each message of that status carries
+    uint8_t count;          // data bytes received for the current message
+    uint8_t data[2];
+    uint8_t message[3];     // last complete message, unused data bytes are 0
+    MidiSysExHandler sysEx; // may be NULL
+} MidiParser;
+
+void MidiParserInitialize(MidiParser* parser, MidiSysExHandler sysEx);
+void MidiParserReset(MidiParser* parser);
+uint8_t MidiParserPush(MidiParser* parser, uint8_t data);
+
+#endif
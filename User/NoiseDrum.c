@@ -1,79 +1,81 @@
 #include <string.h>
 #include "NoiseDrum.h"
+#include "BeepTables.h"
 
-static const uint8_t volumeTable[] =
-{
-    0, 10, 12, 16, 20, 25, 32, 40, 51, 64, 80, 101, 128, 161, 203, 255, 255
-};
+// Level (volume 16 * drum volume 15) * interval * envelopeReciprocal must
+// fit in 32 bits; the reciprocal is under 65536
+#if 240 * (TIME_UNIT / SAMPLING_FREQUENCY_MIN + 1) >= 65536
+#error "SAMPLING_FREQUENCY_MIN too low for the drum envelope step"
+#endif
 
 // Bass Drum
 static const Effect effect000[] =
 {
-    1 * INTERVAL60, 1500 * FREQUENCY_SCALE, 31 * FREQUENCY_SCALE, 54, 15, 0, 0, 127 * FREQUENCY_SCALE, 0, 0,
-    8 * INTERVAL60, 1700 * FREQUENCY_SCALE, 1, 62, 16, 1200 * INTERVAL, 0, 127 * FREQUENCY_SCALE, 0, 0,
+    1 * INTERVAL60, 1500 * FREQUENCY_SCALE, 31 * FREQUENCY_SCALE, 54, 15, ENVELOPE(0), 0, 127 * FREQUENCY_SCALE, 0, 0,
+    8 * INTERVAL60, 1700 * FREQUENCY_SCALE, 1, 62, 16, ENVELOPE(1200), 0, 127 * FREQUENCY_SCALE, 0, 0,
 };
 
 // Snare Drum
 static const Effect effect001[] =
 {
-    14 * INTERVAL60, 400 * FREQUENCY_SCALE, 7 * FREQUENCY_SCALE, 54, 16, 3000 * INTERVAL, 0, 93 * FREQUENCY_SCALE, 15 * INTERVAL60, 2 * FREQUENCY_SCALE,
+    14 * INTERVAL60, 400 * FREQUENCY_SCALE, 7 * FREQUENCY_SCALE, 54, 16, ENVELOPE(3000), 0, 93 * FREQUENCY_SCALE, 15 * INTERVAL60, 2 * FREQUENCY_SCALE,
 };
 
 // Low Tom
 static const Effect effect002[] =
 {
-    2 * INTERVAL60, 700 * FREQUENCY_SCALE, 1, 54, 15, 0, 0, 100 * FREQUENCY_SCALE, 0, 0,
-    14 * INTERVAL60, 900 * FREQUENCY_SCALE, 1, 54, 16, 2500 * INTERVAL, 0, 100 * FREQUENCY_SCALE, 0, 0,
+    2 * INTERVAL60, 700 * FREQUENCY_SCALE, 1, 54, 15, ENVELOPE(0), 0, 100 * FREQUENCY_SCALE, 0, 0,
+    14 * INTERVAL60, 900 * FREQUENCY_SCALE, 1, 54, 16, ENVELOPE(2500), 0, 100 * FREQUENCY_SCALE, 0, 0,
 };
 
 // Middle Tom
 static const Effect effect003[] =
 {
-    2 * INTERVAL60, 500 * FREQUENCY_SCALE, 5 * FREQUENCY_SCALE, 54, 15, 0, 0, 60 * FREQUENCY_SCALE, 0, 0,
-    14 * INTERVAL60, 620 * FREQUENCY_SCALE, 1, 54, 16, 2500 * INTERVAL, 0, 60 * FREQUENCY_SCALE, 0, 0,
+    2 * INTERVAL60, 500 * FREQUENCY_SCALE, 5 * FREQUENCY_SCALE, 54, 15, ENVELOPE(0), 0, 60 * FREQUENCY_SCALE, 0, 0,
+    14 * INTERVAL60, 620 * FREQUENCY_SCALE, 1, 54, 16, ENVELOPE(2500), 0, 60 * FREQUENCY_SCALE, 0, 0,
 };
 
 // High Tom
 static const Effect effect004[] =
 {
-    2 * INTERVAL60, 300 * FREQUENCY_SCALE, 1, 54, 15, 0, 0, 50 * FREQUENCY_SCALE, 0, 0,
-    14 * INTERVAL60, 400 * FREQUENCY_SCALE, 1, 54, 16, 2500 * INTERVAL, 0, 50 * FREQUENCY_SCALE, 0, 0,
+    2 * INTERVAL60, 300 * FREQUENCY_SCALE, 1, 54, 15, ENVELOPE(0), 0, 50 * FREQUENCY_SCALE, 0, 0,
+    14 * INTERVAL60, 400 * FREQUENCY_SCALE, 1, 54, 16, ENVELOPE(2500), 0, 50 * FREQUENCY_SCALE, 0, 0,
 };
 
 // Rim Shot
 static const Effect effect005[] =
 {
-    2 * INTERVAL60, 55 * FREQUENCY_SCALE, 1, 62, 16, 300 * INTERVAL, 0, 100 * FREQUENCY_SCALE, 0, 0,
+    2 * INTERVAL60, 55 * FREQUENCY_SCALE, 1, 62, 16, ENVELOPE(300), 0, 100 * FREQUENCY_SCALE, 0, 0,
 };
 
 // Snare Drum 2
 static const Effect effect006[] =
 {
-    16 * INTERVAL60, 0, 15 * FREQUENCY_SCALE, 55, 16, 3000 * INTERVAL, 0, 0, 15 * INTERVAL60, 1 * FREQUENCY_SCALE,
+    16 * INTERVAL60, 0, 15 * FREQUENCY_SCALE, 55, 16, ENVELOPE(3000), 0, 0, 15 * INTERVAL60, 1 * FREQUENCY_SCALE,
 };
 
 // Hi-Hat Close
 static const Effect effect007[] =
 {
-    6 * INTERVAL60, 39 * FREQUENCY_SCALE, 1, 54, 16, 500 * INTERVAL, 0, 0, 0, 0,
+    6 * INTERVAL60, 39 * FREQUENCY_SCALE, 1, 54, 16, ENVELOPE(500), 0, 0, 0, 0,
 };
 
 // Hi-Hat Open
 static const Effect effect008[] =
 {
-    32 * INTERVAL60, 39 * FREQUENCY_SCALE, 1, 54, 16, 5000 * INTERVAL, 0, 0, 0, 0,
+    32 * INTERVAL60, 39 * FREQUENCY_SCALE, 1, 54, 16, ENVELOPE(5000), 0, 0, 0, 0,
 };
 
 // Crush Cymbal
 static const Effect effect009[] =
 {
-    31 * INTERVAL60, 40 * FREQUENCY_SCALE, 31 * FREQUENCY_SCALE, 54, 16, 5000 * INTERVAL, 0, 0, 15 * INTERVAL60, 1 * FREQUENCY_SCALE,
+    31 * INTERVAL60, 40 * FREQUENCY_SCALE, 31 * FREQUENCY_SCALE, 54, 16, ENVELOPE(5000), 0, 0, 15 * INTERVAL60, 1 * FREQUENCY_SCALE,
 };
 
 // Ride Cymbal
 static const Effect effect010[] =
 {
-    31 * INTERVAL60, 30 * FREQUENCY_SCALE, 1, 54, 16, 5000 * INTERVAL, 0, 0, 0, 0,
+    31 * INTERVAL60, 30 * FREQUENCY_SCALE, 1, 54, 16, ENVELOPE(5000), 0, 0, 0, 0,
 };
 
 const EffectData effectDatas[] =
@@ -109,11 +111,13 @@ unsigned char Rnd(void)
 void NoiseDrumInitialize(Drum* drum)
 {
     memset(drum, 0, sizeof(Drum));
+    drum->phase = 2;
 }
 
 void NoiseDrumSetPlay(Drum* drum, uint8_t index)
 {
     drum->effectData = &effectDatas[index];
+    drum->effectIndex = index;
     drum->playIndex = 0;
     drum->phase = 0;
 }
@@ -123,20 +127,27 @@ void NoiseDrumSetVolume(Drum* drum, uint8_t volume)
     drum->volume = volume;
 }
 
-void NoiseDrumInitializePhase(Drum* drum)
+void NoiseDrumInitializePhase(Drum* drum, uint32_t interval)
 {
+    uint32_t level;
     drum->toneInterval = drum->effectData->data[drum->playIndex].toneFrequency;
     drum->toneIntervalHalf = drum->toneInterval >> 1;
     drum->noiseInterval = drum->effectData->data[drum->playIndex].noiseFrequency;
     drum->noiseReleaseCounter = 0;
     drum->toneSweepCounter = 0;
     drum->noiseSweepCounter = 0;
+    // Linear decay to 0 over envelopeFrequency, stepped once per sample.
+    // This runs in the output interrupt, so the table's reciprocal stands
+    // in for the divide RV32EC lacks.
+    level = (uint32_t)drum->effectData->data[drum->playIndex].volume * drum->volume;
+    drum->envelopeLevel = level << 12;
+    drum->envelopeStep = (level * interval * drum->effectData->data[drum->playIndex].envelopeReciprocal) >> (ENVELOPE_RECIPROCAL_SHIFT - 12);
     drum->phase = 1;
 }
 
 void NoiseDrumNextData(Drum* drum)
 {
-    if(drum->playIndex < drum->effectData[drum->playIndex].dataCount)
+    if((size_t)drum->playIndex + 1 < drum->effectData->dataCount)
     {
         ++ drum->playIndex;
         drum->phase = 0;
@@ -145,7 +156,7 @@ void NoiseDrumNextData(Drum* drum)
     drum->phase = 2;
 }
 
-uint8_t NoiseDrumGetData(Drum* drum)
+uint8_t NoiseDrumGetData(Drum* drum, uint32_t interval)
 {
     if(drum->phase == 2)
     {
@@ -153,22 +164,30 @@ uint8_t NoiseDrumGetData(Drum* drum)
     }
     if(drum->phase == 0)
     {
-        NoiseDrumInitializePhase(drum);
+        NoiseDrumInitializePhase(drum, interval);
     }
     uint8_t data = 0;
-    drum->noiseReleaseCounter += INTERVAL;
+    drum->noiseReleaseCounter += interval;
+    if(drum->envelopeLevel > drum->envelopeStep)
+    {
+        drum->envelopeLevel -= drum->envelopeStep;
+    }
+    else
+    {
+        drum->envelopeLevel = 0;
+    }
     // Tone
     if((drum->effectData->data[drum->playIndex].mixControl & 1) == 0)
     {
         // Tone sweep
-        drum->toneSweepCounter += INTERVAL;
+        drum->toneSweepCounter += interval;
         if((drum->effectData->data[drum->playIndex].toneSweep > 0) && (drum->toneSweepCounter > FPS60_INTERVAL))
         {
             drum->toneInterval += drum->effectData->data[drum->playIndex].toneSweep;
             drum->toneIntervalHalf = drum->toneInterval >> 1;
             drum->toneSweepCounter -= FPS60_INTERVAL;
         }
-        drum->toneCounter += INTERVAL;
+        drum->toneCounter += interval;
         if(drum->toneCounter < drum->toneIntervalHalf)
         {
             data = 1;
@@ -187,13 +206,13 @@ uint8_t NoiseDrumGetData(Drum* drum)
     if((drum->effectData->data[drum->playIndex].mixControl & 8) == 0)
     {
         // Noise sweep
-        drum->noiseSweepCounter += INTERVAL;
+        drum->noiseSweepCounter += interval;
         if((drum->effectData->data[drum->playIndex].noiseSweepCount > 0) && (drum->noiseSweepCounter > drum->effectData->data[drum->playIndex].noiseSweepCount))
         {
             drum->noiseInterval += drum->effectData->data[drum->playIndex].noiseSweepData;
             drum->noiseSweepCounter -= drum->effectData->data[drum->playIndex].noiseSweepCount;
         }
-        drum->counter += INTERVAL;
+        drum->counter += interval;
         if(drum->counter >= drum->noiseInterval)
         {
             // ʌvZ
@@ -235,10 +254,93 @@ uint8_t NoiseDrumGetData(Drum* drum)
             return 0;
         }
         // `⊮
-        uint8_t volume = drum->effectData->data[drum->playIndex].volume - drum->effectData->data[drum->playIndex].volume * drum->noiseReleaseCounter / drum->effectData->data[drum->playIndex].envelopeFrequency;
-        volume = volume * drum->volume / 16;
-        volume = volumeTable[volume];
-        return volume;
+        return volumeTable[drum->envelopeLevel >> 16];
     }
     return 0;
 }
+
+void NoiseDrumPoolInitialize(DrumPool* pool)
+{
+    for(int i = 0; i < DRUM_COUNT; i ++)
+    {
+        NoiseDrumInitialize(&pool->drum[i]);
+    }
+    pool->sequence = 0;
+    pool->intervalFraction = 0;
+}
+
+// At boot and whenever the output rate changes
+void NoiseDrumPoolSetSamplingFrequency(DrumPool* pool, uint32_t frequency)
+{
+    pool->interval = ((TIME_UNIT << 8) + frequency / 2) / frequency;
+}
+
+// Retrigger the drum already playing this effect, else take an idle one,
+// else steal the one started longest ago
+void NoiseDrumPoolSetPlay(DrumPool* pool, uint8_t index)
+{
+    Drum* target = NULL;
+    Drum* oldest = &pool->drum[0];
+    for(int i = 0; i < DRUM_COUNT; i ++)
+    {
+        Drum* drum = &pool->drum[i];
+        if(drum->phase == 2)
+        {
+            if(target == NULL)
+            {
+                target = drum;
+            }
+            continue;
+        }
+        if(drum->effectIndex == index)
+        {
+            target = drum;
+            break;
+        }
+        if((uint8_t)(pool->sequence - drum->sequence) > (uint8_t)(pool->sequence - oldest->sequence))
+        {
+            oldest = drum;
+        }
+    }
+    if(target == NULL)
+    {
+        target = oldest;
+    }
+    target->sequence = ++ pool->sequence;
+    NoiseDrumSetPlay(target, index);
+}
+
+// Silence every drum; each state stays valid for NoiseDrumGetData
+void NoiseDrumPoolStop(DrumPool* pool)
+{
+    for(int i = 0; i < DRUM_COUNT; i ++)
+    {
+        pool->drum[i].phase = 2;
+    }
+}
+
+void NoiseDrumPoolSetVolume(DrumPool* pool, uint8_t volume)
+{
+    for(int i = 0; i < DRUM_COUNT; i ++)
+    {
+        NoiseDrumSetVolume(&pool->drum[i], volume);
+    }
+}
+
+// In RAM: runs every sample even with every drum idle
+RAMFUNC uint16_t NoiseDrumPoolGetData(DrumPool* pool)
+{
+    uint16_t data = 0;
+    // Whole time units this sample, the fraction carried to the next one
+    uint32_t interval = pool->interval + pool->intervalFraction;
+    pool->intervalFraction = (uint8_t)interval;
+    interval >>= 8;
+    for(int i = 0; i < DRUM_COUNT; i ++)
+    {
+        if(pool->drum[i].phase != 2)
+        {
+            data += NoiseDrumGetData(&pool->drum[i], interval);
+        }
+    }
+    return data;
+}
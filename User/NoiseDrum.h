@@ -1,16 +1,30 @@
 #ifndef NOISEDRUM_H
 #define NOISEDRUM_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include "BeepConfig.h"
+#include "RamFunc.h"
 
-#define TIME_UNIT 2000000
-#define OUTPUT_SAMPLING_FREQUENCY 16000
+// The pool advances drum timing by TIME_UNIT / rate each sample
 #define FPS60_INTERVAL (TIME_UNIT / 60)
-#define FPS60_SAMPLING (OUTPUT_SAMPLING_FREQUENCY / 60)
 #define FREQUENCY_SCALE 16
 #define ENVELOPE_FREQUENCY_SCALE 256
-#define INTERVAL (TIME_UNIT / OUTPUT_SAMPLING_FREQUENCY)
+// Envelope lengths in the effect tables count samples at 16kHz
+#define EFFECT_INTERVAL (TIME_UNIT / 16000)
 #define INTERVAL60 (TIME_UNIT / 60)
+// Envelope length for an effect table, in EFFECT_INTERVAL units, preceded
+// by 2^31 / (length * EFFECT_INTERVAL) rounded, so a step finds its
+// per-sample decrement without dividing. The reciprocal is 16 bits, which
+// holds lengths of 263 and up; a shorter one is a negative array size, so
+// the table does not compile.
+#define ENVELOPE(length) ENVELOPE_RECIPROCAL((length) * EFFECT_INTERVAL), (length) * EFFECT_INTERVAL
+#define ENVELOPE_RECIPROCAL(frequency) \
+    ((frequency) == 0 ? 0 : (uint16_t)ENVELOPE_RECIPROCAL_WIDE(frequency) \
+     + 0 * sizeof(char[(frequency) == 0 || ENVELOPE_RECIPROCAL_WIDE(frequency) <= 0xFFFF ? 1 : -1]))
+#define ENVELOPE_RECIPROCAL_WIDE(frequency) \
+    ((0x80000000UL + (frequency) / 2) / ((frequency) == 0 ? 1 : (frequency)))
+#define ENVELOPE_RECIPROCAL_SHIFT 31
 
 typedef struct Effect_
 {
@@ -19,6 +33,7 @@ typedef struct Effect_
     uint16_t noiseFrequency;
     uint8_t mixControl;
     uint8_t volume;
+    uint16_t envelopeReciprocal;
     uint32_t envelopeFrequency;
     uint8_t envelopePattern;
     uint16_t toneSweep;
@@ -36,6 +51,8 @@ typedef struct EffectData_
 typedef struct Drum_
 {
     uint32_t counter;
+    uint8_t effectIndex;
+    uint8_t sequence;
     uint8_t playIndex;
     uint8_t phase;
     const EffectData* effectData;
@@ -45,6 +62,9 @@ typedef struct Drum_
     uint32_t noiseReleaseCounter;
     uint8_t noiseBeforeData;
     uint32_t noiseSweepCounter;
+    // Envelope, volume * drum volume / 16 in 16.16 fixed point
+    uint32_t envelopeLevel;
+    uint32_t envelopeStep;
     // Tone
     uint32_t toneIntervalHalf;
     uint32_t toneInterval;
@@ -52,12 +72,28 @@ typedef struct Drum_
     uint32_t toneSweepCounter;
 } Drum;
 
+// Pool of drums sharing the MIDI channel 10 volume
+typedef struct DrumPool_
+{
+    Drum drum[DRUM_COUNT];
+    uint8_t sequence;
+    // TIME_UNIT per sample in 24.8 fixed point, and the fraction carried
+    uint32_t interval;
+    uint8_t intervalFraction;
+} DrumPool;
+
 extern const EffectData psgEffectDatas[];
 
 unsigned char Rnd(void);
 void NoiseDrumInitialize(Drum* drum);
 void NoiseDrumSetPlay(Drum* drum, uint8_t index);
 void NoiseDrumSetVolume(Drum* drum, uint8_t volume);
-uint8_t NoiseDrumGetData(Drum* drum);
+uint8_t NoiseDrumGetData(Drum* drum, uint32_t interval);
+void NoiseDrumPoolInitialize(DrumPool* pool);
+void NoiseDrumPoolSetSamplingFrequency(DrumPool* pool, uint32_t frequency);
+void NoiseDrumPoolSetPlay(DrumPool* pool, uint8_t index);
+void NoiseDrumPoolStop(DrumPool* pool);
+void NoiseDrumPoolSetVolume(DrumPool* pool, uint8_t volume);
+uint16_t NoiseDrumPoolGetData(DrumPool* pool) RAMFUNC;
 
 #endif
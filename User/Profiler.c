@@ -0,0 +1,145 @@
+// Rendering interrupt cycle profiler
+//
+//  Output: PD5 TX, telemetry frames (see Telemetry.h)
+//
+// The rendering interrupt records into isrStats. The main loop calls
+// ProfilerPoll after each pass over the received MIDI bytes; once per
+// TELEMETRY_INTERVAL ticks, or after ProfilerRequest, the window is copied
+// into a frame and handed to DMA1_Channel4 (USART1_TX), so sending costs
+// no CPU time.
+
+#include <stddef.h>
+#include <string.h>
+#include "Profiler.h"
+
+IsrStats isrStats = { .min = 0xFFFF };
+volatile uint8_t mainAwake = 1;
+
+static uint8_t telemetryFrame[TELEMETRY_FRAME_SIZE(sizeof(IsrStats))];
+static volatile uint8_t telemetryRequested;
+
+static void ProfilerReset(void)
+{
+    memset(&isrStats, 0, sizeof(isrStats));
+    isrStats.min = 0xFFFF;
+}
+
+// PD5 TX and DMA1_Channel4, after SetupUSART
+void SetupProfiler(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure = {0};
+    DMA_InitTypeDef DMA_InitStructure = {0};
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_5;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
+    GPIO_Init(GPIOD, &GPIO_InitStructure);
+
+    DMA_DeInit(DMA1_Channel4);
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (u32)&USART1->DATAR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (u32)telemetryFrame;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+    DMA_InitStructure.DMA_BufferSize = sizeof(telemetryFrame);
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_Low;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel4, &DMA_InitStructure);
+    USART_DMACmd(USART1, USART_DMAReq_Tx, ENABLE);
+
+    telemetryRequested = 0;
+    ProfilerReset();
+}
+
+void ProfilerRecord(uint32_t enter, uint32_t exit)
+{
+    uint32_t cycles = exit - enter;
+    uint32_t bin = cycles >> TELEMETRY_HISTOGRAM_SHIFT;
+    // min and max are 16 bits, and saturate like worstLate
+    uint16_t clamped = cycles > UINT16_MAX ? UINT16_MAX : cycles;
+    if(clamped < isrStats.min)
+    {
+        isrStats.min = clamped;
+    }
+    if(clamped > isrStats.max)
+    {
+        isrStats.max = clamped;
+    }
+    isrStats.total += cycles;
+    isrStats.mainAwake += mainAwake;
+    ++ isrStats.count;
+    if(bin >= TELEMETRY_HISTOGRAM_BINS)
+    {
+        bin = TELEMETRY_HISTOGRAM_BINS - 1;
+    }
+    ++ isrStats.histogram[bin];
+}
+
+void ProfilerLate(uint32_t late, uint32_t missed)
+{
+    if(late > isrStats.worstLate)
+    {
+        isrStats.worstLate = late > UINT16_MAX ? UINT16_MAX : late;
+    }
+    if(missed != 0)
+    {
+        ++ isrStats.overruns;
+        isrStats.missed += missed;
+    }
+}
+
+// Send the current window without waiting for the interval
+void ProfilerRequest(void)
+{
+    telemetryRequested = 1;
+}
+
+// A report is due, so the main loop should not go to sleep
+uint8_t ProfilerPending(void)
+{
+    return telemetryRequested || isrStats.count >= TELEMETRY_INTERVAL;
+}
+
+// rxOverruns goes into the frame as it is
+void ProfilerPoll(uint32_t rxOverruns)
+{
+    uint8_t sum;
+    uint32_t i;
+
+    if(!ProfilerPending())
+    {
+        return;
+    }
+    // Previous frame still on the wire
+    if(DMA_GetCurrDataCounter(DMA1_Channel4) != 0 && (DMA1_Channel4->CFGR & DMA_CFGR1_EN))
+    {
+        return;
+    }
+    DMA_Cmd(DMA1_Channel4, DISABLE);
+
+    // Take the window in one piece, SysTick_Handler writes it every tick
+    __disable_irq();
+    memcpy(&telemetryFrame[TELEMETRY_HEADER_SIZE], &isrStats, sizeof(isrStats));
+    ProfilerReset();
+    __enable_irq();
+    telemetryRequested = 0;
+    memcpy(&telemetryFrame[TELEMETRY_HEADER_SIZE + offsetof(IsrStats, rxOverruns)], &rxOverruns, sizeof(rxOverruns));
+
+    telemetryFrame[0] = TELEMETRY_SYNC;
+    telemetryFrame[1] = TELEMETRY_TYPE_ISR;
+    telemetryFrame[2] = sizeof(isrStats);
+    sum = 0;
+    for(i = 0; i < sizeof(telemetryFrame) - 1; ++ i)
+    {
+        sum += telemetryFrame[i];
+    }
+    telemetryFrame[sizeof(telemetryFrame) - 1] = sum;
+
+    // TC then stays clear until this frame's last byte is out
+    USART_ClearFlag(USART1, USART_FLAG_TC);
+    DMA_SetCurrDataCounter(DMA1_Channel4, sizeof(telemetryFrame));
+    DMA_Cmd(DMA1_Channel4, ENABLE);
+}
@@ -0,0 +1,36 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "debug.h"
+#include "BeepSynth.h"
+#include "BlockOutput.h"
+#include "Telemetry.h"
+
+// 0 removes the timing code from the rendering interrupt
+#define ISR_PROFILE                 1
+
+// One report per second of rendering interrupts
+#if BLOCK_OUTPUT
+#define TELEMETRY_INTERVAL          (outputSamplingFrequency / OUTPUT_BLOCK_LENGTH)
+#else
+#define TELEMETRY_INTERVAL          outputSamplingFrequency
+#endif
+
+extern IsrStats isrStats;
+// Cleared by the main loop while it sleeps in WFI
+extern volatile uint8_t mainAwake;
+
+void SetupProfiler(void);
+void ProfilerRequest(void);
+void ProfilerPoll(uint32_t rxOverruns);
+uint8_t ProfilerPending(void);
+
+// Called at the end of the rendering interrupt with the SysTick->CNT read
+// on entry and on exit. The counter runs at HCLK, so the difference is in
+// cycles. Not RAMFUNC: with RAM_FUNCTIONS the RAM goes to the rendering.
+void ProfilerRecord(uint32_t enter, uint32_t exit);
+// Called by the rendering interrupt with the cycles it started after its
+// tick was due, and the ticks it had to give up on
+void ProfilerLate(uint32_t late, uint32_t missed);
+
+#endif
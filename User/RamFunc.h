@@ -0,0 +1,18 @@
+#ifndef RAMFUNC_H
+#define RAMFUNC_H
+
+// 1: code marked RAMFUNC is linked into .ramfunc, which the startup code
+//    copies to RAM, and runs there without flash wait states
+// 0: everything runs from flash, leaving the RAM to voices and buffers
+#define RAM_FUNCTIONS             1
+
+// For the per-sample path only: every byte here comes out of the 2K RAM,
+// and Ld/Link.ld stops the link if the 256-byte stack no longer fits.
+// Host builds ignore it.
+#if RAM_FUNCTIONS && defined(__riscv)
+#define RAMFUNC                   __attribute__((section(".ramfunc"), noinline))
+#else
+#define RAMFUNC
+#endif
+
+#endif
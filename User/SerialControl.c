@@ -0,0 +1,63 @@
+#include "SerialControl.h"
+
+const uint32_t serialRates[SERIAL_RATE_COUNT] = { 31250, 38400, 115200, 230400, 1000000 };
+const uint32_t samplingFrequencies[SAMPLING_FREQUENCY_COUNT] = { 8000, 11025, 16000, 22050, 32000 };
+
+void SerialControlInitialize(SerialControl* control)
+{
+    control->length = 0xFF;
+    control->command = 0;
+    control->index = 0;
+}
+
+// Feed every SysEx event MidiParser passes on. Returns SYSEX_SERIAL_RATE
+// or SYSEX_SAMPLING_FREQUENCY at the F7 of a rate message with a known
+// index, with the rate it selects in *rate, and 0 otherwise.
+uint8_t SerialControlSysEx(SerialControl* control, uint8_t event, uint8_t data, uint32_t* rate)
+{
+    switch(event)
+    {
+    case MIDI_SYSEX_START:
+        control->length = 0;
+        break;
+    case MIDI_SYSEX_DATA:
+        if(control->length == 0 && data != SYSEX_NON_COMMERCIAL)
+        {
+            control->length = 0xFF;
+        }
+        else if(control->length == 1 && data != SYSEX_SERIAL_RATE && data != SYSEX_SAMPLING_FREQUENCY)
+        {
+            control->length = 0xFF;
+        }
+        else if(control->length == 1)
+        {
+            control->command = data;
+        }
+        else if(control->length == 2)
+        {
+            control->index = data;
+        }
+        if(control->length != 0xFF)
+        {
+            ++ control->length;
+        }
+        break;
+    case MIDI_SYSEX_END:
+        if(control->length == 3 && control->command == SYSEX_SERIAL_RATE && control->index < SERIAL_RATE_COUNT)
+        {
+            *rate = serialRates[control->index];
+            return SYSEX_SERIAL_RATE;
+        }
+        if(control->length == 3 && control->command == SYSEX_SAMPLING_FREQUENCY && control->index < SAMPLING_FREQUENCY_COUNT)
+        {
+            *rate = samplingFrequencies[control->index];
+            return SYSEX_SAMPLING_FREQUENCY;
+        }
+        break;
+    default:
+        // MIDI_SYSEX_ABORT: only a new F0 starts over
+        control->length = 0xFF;
+        break;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef SERIALCONTROL_H
+#define SERIALCONTROL_H
+
+#include <stdint.h>
+#include "MidiParser.h"
+
+// What the firmware does with the serial stream besides playing it, shared
+// with beeprender so both read the stream the same way
+
+// Receive ring DMA1_Channel5 writes into, a power of 2
+#define RX_BUFFER_LENGTH          256
+
+// Rates SysEx F0 7D 01 nn F7 can switch to, by index nn. 7D is the
+// non-commercial manufacturer ID. The switch happens after the F7, so the
+// sender changes its rate once the message is out.
+#define SYSEX_NON_COMMERCIAL      0x7D
+#define SYSEX_SERIAL_RATE         0x01
+#define SERIAL_RATE_COUNT         5
+extern const uint32_t serialRates[SERIAL_RATE_COUNT];
+// Output rates F0 7D 02 nn F7 can switch to; every note is released
+#define SYSEX_SAMPLING_FREQUENCY  0x02
+#define SAMPLING_FREQUENCY_COUNT  5
+extern const uint32_t samplingFrequencies[SAMPLING_FREQUENCY_COUNT];
+
+// Progress through the SysEx being received
+typedef struct SerialControl_
+{
+    uint8_t length;         // data bytes so far, 0xFF once it is not ours
+    uint8_t command;
+    uint8_t index;
+} SerialControl;
+
+void SerialControlInitialize(SerialControl* control);
+uint8_t SerialControlSysEx(SerialControl* control, uint8_t event, uint8_t data, uint32_t* rate);
+
+#endif
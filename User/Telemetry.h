@@ -0,0 +1,50 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+// Binary frames sent on USART1 TX
+//
+//  [0]      TELEMETRY_SYNC
+//  [1]      frame type
+//  [2]      payload length
+//  [3..]    payload, little endian
+//  [last]   8bit sum of every previous byte
+#define TELEMETRY_SYNC              0xA5
+#define TELEMETRY_HEADER_SIZE       3
+#define TELEMETRY_FRAME_SIZE(n)     (TELEMETRY_HEADER_SIZE + (n) + 1)
+
+#define TELEMETRY_TYPE_ISR          0x01
+
+// MIDI real-time byte (undefined in the spec) asking for a report now
+#define TELEMETRY_REQUEST           0xFD
+
+// 256 cycles per histogram bin, the last bin also holds everything above
+#define TELEMETRY_HISTOGRAM_BINS    16
+#define TELEMETRY_HISTOGRAM_SHIFT   8
+
+// Payload of TELEMETRY_TYPE_ISR: SysTick_Handler cycles over one report window.
+// min and max stop at 0xFFFF; total does not.
+// mainAwake counts the interrupts that found the main loop out of WFI, so
+// mainAwake / count is its duty cycle.
+// Timing health: worstLate is the most cycles an interrupt started after
+// its tick was due (0xFFFF or more saturates), overruns the interrupts that
+// started too late to keep every tick, and missed the ticks lost that way.
+// rxOverruns counts, since boot, the times the receive ring was lapped and
+// unread MIDI bytes were dropped; any at all means the ring is too small
+// for the stream.
+typedef struct IsrStats_
+{
+    uint32_t count;
+    uint32_t total;
+    uint32_t mainAwake;
+    uint32_t missed;
+    uint32_t rxOverruns;
+    uint16_t min;
+    uint16_t max;
+    uint16_t overruns;
+    uint16_t worstLate;
+    uint16_t histogram[TELEMETRY_HISTOGRAM_BINS];
+} IsrStats;
+
+#endif
@@ -5,77 +5,43 @@
 //  Output: PC1 LED
 
 #include "debug.h"
-#include "NoiseDrum.h"
+#include "BeepSynth.h"
+#include "Profiler.h"
+#include "BlockOutput.h"
+#include "MidiParser.h"
+#include "SerialControl.h"
 
-#define TIME_UNIT                 2000000
-#define OUTPUT_SAMPLING_FREQUENCY 16000
-#define PSG_DEVIDE_FACTOR         9
-#define CHANNEL_COUNT             20
-#define SAMPLING_INTERVAL         (TIME_UNIT/OUTPUT_SAMPLING_FREQUENCY)
 #define RX_BUFFER_LEN             256
 #define SERIAL_BPS                38400
 //#define SERIAL_BPS                31250
 
-// Beep structure
-typedef struct Beep_
-{
-    uint32_t psg_osc_intervalHalf;
-    uint32_t psg_osc_interval;
-    uint32_t psg_osc_counter;
-    uint8_t psg_tone_on;
-    uint8_t psg_midi_inuse;
-    uint8_t psg_midi_inuse_ch;
-    uint8_t psg_midi_note;
-} Beep;
-
-// Volume table
-static const uint16_t psg_volume[] = { 0x00, 0x00, 0x17, 0x20, 0x27, 0x30, 0x37, 0x40,
-        0x47, 0x50, 0x57, 0x60, 0x67, 0x70, 0x77, 0x80, 0x87, 0x90, 0x97, 0xa0,
-        0xa7, 0xb0, 0xb7, 0xc0, 0xc7, 0xd0, 0xd7, 0xe0, 0xe7, 0xf0, 0xf7, 0xff };
-
-// Note̎g̔̒l
-static const uint32_t toneIntervalHalf[] =
-{
-
-    122312, 115447, 108967, 102851, 97079, 91630, 86487, 81633,
-    77051, 72727, 68645, 64792, 61156, 57723, 54483, 51425,
-    48539, 45815, 43243, 40816, 38525, 36363, 34322, 32396,
-    30578, 28861, 27241, 25712, 24269, 22907, 21621, 20408,
-    19262, 18181, 17161, 16198, 15289, 14430, 13620, 12856,
-    12134, 11453, 10810, 10204, 9631, 9090, 8580, 8099,
-    7644, 7215, 6810, 6428, 6067, 5726, 5405, 5102,
-    4815, 4545, 4290, 4049, 3822, 3607, 3405, 3214,
-    3033, 2863, 2702, 2551, 2407, 2272, 2145, 2024,
-    1911, 1803, 1702, 1607, 1516, 1431, 1351, 1275,
-    1203, 1136, 1072, 1012, 955, 901, 851, 803,
-    758, 715, 675, 637, 601, 568, 536, 506,
-    477, 450, 425, 401, 379, 357, 337, 318,
-    300, 284, 268, 253, 238, 225, 212, 200,
-    189, 178, 168, 159, 150, 142, 134, 126,
-    119, 112, 106, 100, 94, 89, 84, 79
-};
-
-// Ym[gϊe[u
-static const uint8_t Note35_57ChangeTable[] =
-{
-	0 , 0, 5, 1, 255, 6, 2, 7,
-	4, 255, 2, 8, 3, 3, 9, 4,
-	10, 255, 255, 255, 255, 255, 9
-};
+// 1 sleeps in WFI while no received MIDI bytes are waiting
+#define IDLE_SLEEP                1
 
 // MOobt@
-#define RX_BUFFER_LENGTH 256
 volatile uint8_t rxBuffer[RX_BUFFER_LENGTH];
-uint8_t rxIndex = 0;
-uint32_t lastRxIndex = RX_BUFFER_LENGTH;
-
-// Beep
-Beep beep[CHANNEL_COUNT];
+#if (RX_BUFFER_LENGTH & (RX_BUFFER_LENGTH - 1)) != 0
+#error "RX_BUFFER_LENGTH must be a power of 2"
+#endif
+// Bytes taken from rxBuffer, and halves of it DMA has filled, since boot
+uint32_t rxRead = 0;
+volatile uint32_t rxHalfCount = 0;
+// Times DMA lapped the parser and unread bytes were dropped
+volatile uint32_t rxOverrunCount = 0;
+// Cycles per output tick, and how far ahead of the counter the next one
+// has to be scheduled to be sure it is not missed
+static uint32_t tickPeriod;
+#define SYSTICK_MARGIN            64
+
+// Set by the interrupts that mean received bytes are worth parsing
+volatile uint8_t rxEvent = 0;
+
+// PWM output
 uint16_t psg_master_volume;
-uint8_t midi_ch_volume[16];
 
-// NoiseDrum
-Drum drum;
+// MIDI-In
+MidiParser midiParser;
+SerialControl serialControl;
 
 // LED
 static int ledCount = 0;
@@ -147,40 +113,26 @@ void BlinkLED(void)
     }
 }
 
-void psg_reset(void)
-{
-    for(int i = 0; i < CHANNEL_COUNT; i ++)
-    {
-        beep[i].psg_osc_intervalHalf = UINT32_MAX;
-        beep[i].psg_osc_interval = UINT32_MAX;
-        beep[i].psg_osc_counter = 0;
-        beep[i].psg_tone_on = 0;
-        beep[i].psg_midi_inuse=0;
-    }
-}
-
-static inline void noteon(uint8_t i, uint8_t note, uint8_t volume)
-{
-    beep[i].psg_osc_intervalHalf = toneIntervalHalf[note];
-    beep[i].psg_osc_interval = toneIntervalHalf[note] << 1;
-    beep[i].psg_osc_counter = 0;
-    beep[i].psg_tone_on = 1;
-}
-
-static inline void noteoff(uint8_t i, uint8_t note)
+// VA
+// 8N1 at the given rate. Leaves the interrupt and DMA enables alone.
+static void UsartInit(uint32_t bps)
 {
-    beep[i].psg_osc_intervalHalf = UINT32_MAX;
-    beep[i].psg_osc_interval = UINT32_MAX;
-    beep[i].psg_tone_on = 0;
+    USART_InitTypeDef USART_InitStructure = {0};
+    USART_InitStructure.USART_BaudRate = bps;
+    USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+    USART_InitStructure.USART_StopBits = USART_StopBits_1;
+    USART_InitStructure.USART_Parity = USART_Parity_No;
+    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+    USART_InitStructure.USART_Mode = USART_Mode_Tx | USART_Mode_Rx;
+    USART_Init(USART1, &USART_InitStructure);
 }
 
-// VA
 // PD6 RX (MIDI-In) Setting
 void SetupUSART(uint32_t bps)
 {
     GPIO_InitTypeDef  GPIO_InitStructure = {0};
-    USART_InitTypeDef USART_InitStructure = {0};
     DMA_InitTypeDef DMA_InitStructure = {0};
+    NVIC_InitTypeDef NVIC_InitStructure = {0};
     RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOD | RCC_APB2Periph_USART1, ENABLE);
 
     // GPIO Setting
@@ -190,14 +142,9 @@ void SetupUSART(uint32_t bps)
     GPIO_Init(GPIOD, &GPIO_InitStructure);
 
     // USART Setting
-    USART_InitStructure.USART_BaudRate = bps;
-    USART_InitStructure.USART_WordLength = USART_WordLength_8b;
-    USART_InitStructure.USART_StopBits = USART_StopBits_1;
-    USART_InitStructure.USART_Parity = USART_Parity_No;
-    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
-    USART_InitStructure.USART_Mode = USART_Mode_Tx | USART_Mode_Rx;
-    USART_Init(USART1, &USART_InitStructure);
+    UsartInit(bps);
     USART_DMACmd(USART1, USART_DMAReq_Rx, ENABLE);
+    USART_ITConfig(USART1, USART_IT_IDLE, ENABLE);
     USART_Cmd(USART1, ENABLE);
 
     // DMA Setting
@@ -215,105 +162,256 @@ void SetupUSART(uint32_t bps)
     DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
     DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
     DMA_Init(DMA1_Channel5, &DMA_InitStructure);
+    DMA_ITConfig(DMA1_Channel5, DMA_IT_HT | DMA_IT_TC, ENABLE);
     DMA_Cmd(DMA1_Channel5, ENABLE);
+
+    // Count filled halves for lap detection
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel5_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    // Wake the main loop when the line goes quiet after a burst
+    NVIC_InitStructure.NVIC_IRQChannel = USART1_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
 }
 
-// VA1oCgǂݍ
-static inline uint8_t ReadByte()
+void USART1_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
+
+void USART1_IRQHandler(void)
 {
-    uint8_t byteData;
-    // f[^܂ő҂
-    while(1)
+    if(USART_GetITStatus(USART1, USART_IT_IDLE))
     {
-        if(DMA_GetCurrDataCounter(DMA1_Channel5) != lastRxIndex)
-        {
-            break;
-        }
+        // IDLE clears on a STATR read followed by a DATAR read
+        (void)USART_ReceiveData(USART1);
+        rxEvent = 1;
     }
-    byteData = rxBuffer[rxIndex];
-    -- lastRxIndex;
-    if(lastRxIndex == 0)
+}
+
+void DMA1_Channel5_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
+
+void DMA1_Channel5_IRQHandler(void)
+{
+    if(DMA_GetITStatus(DMA1_IT_HT5))
     {
-        lastRxIndex = RX_BUFFER_LENGTH;
+        DMA_ClearITPendingBit(DMA1_IT_HT5);
+        ++ rxHalfCount;
     }
-    ++ rxIndex;
-    if(rxIndex >= RX_BUFFER_LENGTH)
+    if(DMA_GetITStatus(DMA1_IT_TC5))
     {
-        rxIndex = 0;
+        DMA_ClearITPendingBit(DMA1_IT_TC5);
+        ++ rxHalfCount;
     }
-    return byteData;
+    rxEvent = 1;
 }
 
-// ^C}荞ݐݒ
-void SetupSysTick(void)
+// Change the rate on the fly. A telemetry frame on the wire is finished
+// first: DMA hands over its last byte, then TC, which ProfilerPoll clears
+// when it starts a frame, marks that byte out. Received bytes keep
+// flowing into rxBuffer through DMA.
+static void SetSerialRate(uint32_t bps)
 {
-    // 荞ݗDxݒ
-    NVIC_PriorityGroupConfig(NVIC_PriorityGroup_2);
-    // ^C}荞ݐݒ
-    NVIC_EnableIRQ(SysTicK_IRQn);
-    SysTick->SR &= ~(1 << 0);
-    SysTick->CMP = (SystemCoreClock / OUTPUT_SAMPLING_FREQUENCY) - 1;
-    SysTick->CNT = 0;
-    SysTick->CTLR = 0xF;
+    while(DMA_GetCurrDataCounter(DMA1_Channel4) != 0 && (DMA1_Channel4->CFGR & DMA_CFGR1_EN))
+    {
+    }
+    while(USART_GetFlagStatus(USART1, USART_FLAG_TC) == RESET)
+    {
+    }
+    USART_Cmd(USART1, DISABLE);
+    UsartInit(bps);
+    USART_Cmd(USART1, ENABLE);
 }
 
-void SysTick_Handler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
+// Change the output rate on the fly. The rendering interrupt takes the new
+// period when it next schedules itself.
+static void SetSamplingFrequency(uint32_t frequency)
+{
+    BeepSynthSetSamplingFrequency(frequency);
+#if BLOCK_OUTPUT
+    SetBlockOutputPeriod();
+#else
+    tickPeriod = outputSamplePeriod;
+#endif
+}
 
-void SysTick_Handler(void)
+// The voice command queue is full: the rendering interrupt empties it
+void BeepSynthWait(void)
 {
-    uint16_t master_volume;
-    uint8_t tone_output[CHANNEL_COUNT];
-    TIM1->CH4CVR = psg_master_volume;
-// Run Oscillator
-    for(int i = 0; i < CHANNEL_COUNT; i ++)
+    __WFI();
+}
+
+// SysEx goes to the synth, and F0 7D 01 nn F7 also selects serialRates[nn],
+// F0 7D 02 nn F7 samplingFrequencies[nn]
+static void ReceiveSysEx(uint8_t event, uint8_t data)
+{
+    uint32_t rate;
+
+    BeepSynthSysEx(event, data);
+    switch(SerialControlSysEx(&serialControl, event, data, &rate))
     {
-        uint32_t pon_count = beep[i].psg_osc_counter += SAMPLING_INTERVAL;
-        if(pon_count < (beep[i].psg_osc_intervalHalf))
-        {
-            tone_output[i] = beep[i].psg_tone_on;
-        }
-        else if (pon_count > beep[i].psg_osc_interval)
+    case SYSEX_SERIAL_RATE:
+        SetSerialRate(rate);
+        break;
+    case SYSEX_SAMPLING_FREQUENCY:
+        SetSamplingFrequency(rate);
+        break;
+    }
+}
+
+// Bytes DMA has written into rxBuffer since boot. The write position only
+// gives the count modulo the buffer; the half count gives the laps. A half
+// whose interrupt is still pending is covered by the position.
+static uint32_t RxWritten(void)
+{
+    uint32_t half = rxHalfCount * (RX_BUFFER_LENGTH / 2);
+    uint32_t position = RX_BUFFER_LENGTH - DMA_GetCurrDataCounter(DMA1_Channel5);
+    return half + ((position - half) & (RX_BUFFER_LENGTH - 1));
+}
+
+// Parse every byte DMA1_Channel5 has written since the last call, without
+// waiting for more
+static void ReceiveMidi(void)
+{
+    uint32_t written = RxWritten();
+    if(written - rxRead > RX_BUFFER_LENGTH)
+    {
+        // Unread bytes were overwritten; skip to the newest and resync
+        ++ rxOverrunCount;
+        rxRead = written;
+        MidiParserReset(&midiParser);
+    }
+    while(rxRead != written)
+    {
+        uint8_t data = rxBuffer[rxRead & (RX_BUFFER_LENGTH - 1)];
+        ++ rxRead;
+        if(!MidiParserPush(&midiParser, data))
         {
-            beep[i].psg_osc_counter -= beep[i].psg_osc_interval;
-            tone_output[i] = beep[i].psg_tone_on;
+            continue;
         }
-        else
+        BlinkLED();
+#if ISR_PROFILE
+        if(midiParser.message[0] == TELEMETRY_REQUEST)
         {
-            tone_output[i] = 0;
+            ProfilerRequest();
         }
+#endif
+        BeepSynthMessage(midiParser.message[0], midiParser.message[1], midiParser.message[2]);
     }
-// Mixer
-    master_volume = 0;
-    for(int i = 0; i < CHANNEL_COUNT; i ++)
+}
+
+#if IDLE_SLEEP
+// Sleep until a received burst has ended, half of rxBuffer has filled, a
+// report is due or the governor has to shed a voice. Any other interrupt,
+// such as the rendering one, wakes WFI too; it only rechecks and sleeps
+// again. An event that lands between the check and WFI waits for the next
+// rendering interrupt at most.
+static void IdleWait(void)
+{
+#if ISR_PROFILE
+    mainAwake = 0;
+#endif
+    while(!rxEvent)
     {
-        if(beep[i].psg_tone_on == 1)
+#if ISR_PROFILE
+        if(ProfilerPending())
         {
-            if(tone_output[i] != 0)
-            {
-                master_volume += psg_volume[midi_ch_volume[beep[i].psg_midi_inuse_ch] * 2 + 1];
-            }
+            break;
+        }
+#endif
+#if POLYPHONY_GOVERNOR
+        if(BeepSynthGovernPending())
+        {
+            break;
         }
+#endif
+        __WFI();
     }
-    master_volume += NoiseDrumGetData(&drum);
-    psg_master_volume = master_volume / PSG_DEVIDE_FACTOR;
-    if(psg_master_volume > 255)
+    rxEvent = 0;
+#if ISR_PROFILE
+    mainAwake = 1;
+#endif
+}
+#endif
+
+// ^C}荞ݐݒ
+void SetupSysTick(void)
+{
+    // ^C}荞ݐݒ
+    NVIC_EnableIRQ(SysTicK_IRQn);
+    // The counter runs free and the handler moves CMP on by one period, so
+    // at entry CNT - CMP tells how late the tick is
+    tickPeriod = outputSamplePeriod;
+    SysTick->SR &= ~(1 << 0);
+    SysTick->CMP = tickPeriod;
+    SysTick->CNT = 0;
+    SysTick->CTLR = 0x7;
+}
+
+#if !BLOCK_OUTPUT
+void SysTick_Handler(void) __attribute__((interrupt("WCH-Interrupt-fast"))) RAMFUNC;
+
+void SysTick_Handler(void)
+{
+    uint32_t due = SysTick->CMP;
+    uint32_t enter = SysTick->CNT;
+    uint32_t next = due + tickPeriod;
+    uint32_t missed = 0;
+    uint32_t rendered;
+    TIM1->CH4CVR = psg_master_volume;
+    psg_master_volume = BeepSynthGetData();
+    rendered = SysTick->CNT;
+#if ISR_PROFILE
+    ProfilerRecord(enter, rendered);
+#endif
+#if POLYPHONY_GOVERNOR
+    // Since entry only: lateness is not render cost, ProfilerLate has it
+    BeepSynthRenderCycles(rendered - enter, 1);
+#endif
+    SysTick->SR &= 0;
+    // CMP only matches on equality, so it has to stay ahead of the counter.
+    // Ticks that can no longer be met in time are skipped and counted.
+    while((int32_t)(next - SysTick->CNT) < SYSTICK_MARGIN)
     {
-        psg_master_volume = 255;
+        next += tickPeriod;
+        ++ missed;
     }
-    SysTick->SR &= 0;
+    SysTick->CMP = next;
+#if ISR_PROFILE
+    ProfilerLate(enter - due, missed);
+#else
+    (void)enter;
+    (void)missed;
+    (void)rendered;
+#endif
 }
+#endif
 
 // C
 int main(void)
 {
-    uint8_t midicc1, midicc2, midinote, midivel;
-    uint8_t override;
+    // Before any NVIC_Init, which encodes priorities for the group set here
+    // 荞ݗDxݒ
+    NVIC_PriorityGroupConfig(NVIC_PriorityGroup_2);
+
+    // Receive first: DMA keeps what a sender starts right after reset while
+    // the synth derives its rate tables, and the main loop parses it later
+    // VA
+    SetupUSART(SERIAL_BPS);
 
+    // Before any rendering interrupt: the drums and the voice list have to
+    // be idle, and the rate set, before BeepSynthGetData first runs
+    psg_master_volume = 0;
+    BeepSynthInitialize();
+
+#if !BLOCK_OUTPUT
     // 荞ݏ
     SetupSysTick();
+#endif
 
-    // VA
-    SetupUSART(SERIAL_BPS);
+#if ISR_PROFILE
+    SetupProfiler();
+#endif
 
     // PWMݒ
     SetupOutput();
@@ -322,137 +420,27 @@ int main(void)
     // LED
     SetupLed();
 
-    // Drum
-    NoiseDrumInitialize(&drum);
-
     // PowerLED
     GPIO_WriteBit(GPIOC, GPIO_Pin_2, Bit_SET);
 
-    psg_master_volume = 0;
-    psg_reset();
+    SerialControlInitialize(&serialControl);
+    MidiParserInitialize(&midiParser, ReceiveSysEx);
+#if BLOCK_OUTPUT
+    SetupBlockOutput();
+#endif
 
     while(1)
     {
         // Listen USART
-        uint8_t midicmd = ReadByte();
-        uint8_t midich = midicmd&0xf;
-        BlinkLED();
-        switch(midicmd & 0xF0)
-        {
-        case 0x80: // Note off
-            midinote = ReadByte();
-            midivel = ReadByte();
-            for(int i = 0; i < CHANNEL_COUNT; i ++)
-            {
-                if((beep[i].psg_midi_inuse == 1) && (beep[i].psg_midi_inuse_ch == midich) && (beep[i].psg_midi_note == midinote))
-                {
-                    noteoff(i, midinote);
-                    beep[i].psg_midi_inuse = 0;
-                }
-            }
-            break;
-        case 0x90: // Note on
-            midinote = ReadByte();
-            midivel = ReadByte();
-            if(midich != 9)
-            {
-                if(midivel != 0)
-                {
-                    // check note is already on
-                    override = 0;
-                    for(int i = 0; i < CHANNEL_COUNT; i ++)
-                    {
-                        if((beep[i].psg_midi_inuse == 1) && (beep[i].psg_midi_inuse_ch == midich) && (beep[i].psg_midi_note == midinote))
-                        {
-                            override=1;
-                        }
-                    }
-                    if(override == 0)
-                    {
-                        for(int i = 0; i < CHANNEL_COUNT; i ++)
-                        {
-                            if(beep[i].psg_midi_inuse == 0)
-                            {
-                                noteon(i, midinote,midi_ch_volume[midich]);
-                                beep[i].psg_midi_inuse = 1;
-                                beep[i].psg_midi_inuse_ch = midich;
-                                beep[i].psg_midi_note = midinote;
-                                break;
-                            }
-                        }
-                    }
-                } else {
-                    for(int i = 0; i < CHANNEL_COUNT; i ++)
-                    {
-                        if((beep[i].psg_midi_inuse == 1) && (beep[i].psg_midi_inuse_ch == midich) && (beep[i].psg_midi_note == midinote))
-                        {
-                            noteoff(i, midinote);
-                            beep[i].psg_midi_inuse = 0;
-                        }
-                    }
-                }
-            }
-            else
-            {
-                if((35 <= midinote) && (midinote <= 57))
-                {
-                    uint8_t rythmNote = Note35_57ChangeTable[midinote - 35];
-                    if(rythmNote < 11)
-                    {
-                        NoiseDrumSetPlay(&drum, rythmNote);
-                    }
-                }
-            }
-            break;
-        case 0xB0:
-            // Channel control
-            midicc1 = ReadByte();
-            switch(midicc1)
-            {
-            case 7:
-            case 11: // Expression
-                midicc2 = ReadByte();
-                midi_ch_volume[midich] = (midicc2 >> 3);
-                if(midich == 9)
-                {
-                    NoiseDrumSetVolume(&drum, midi_ch_volume[midich]);
-                }
-                break;
-
-            case 0: //Bank select
-            case 120:// All note off
-            case 121:// All reset
-            case 123:
-            case 124:
-            case 125:
-            case 126:
-            case 127:
-                for(int i = 0; i < CHANNEL_COUNT; i ++)
-                {
-                    if((beep[i].psg_midi_inuse == 1) && (beep[i].psg_midi_inuse_ch == midich))
-                    {
-                        noteoff(i, beep[i].psg_midi_note);
-                        beep[i].psg_midi_inuse = 0;
-                    }
-                }
-                break;
-            default:
-                break;
-            }
-            break;
-        case 0xC0:
-            // Program change
-            for(int i = 0; i < CHANNEL_COUNT; i ++)
-            {
-                if((beep[i].psg_midi_inuse == 1) && (beep[i].psg_midi_inuse_ch == midich))
-                {
-                    noteoff(i, beep[i].psg_midi_note);
-                    beep[i].psg_midi_inuse = 0;
-                }
-            }
-            break;
-        default: // Skip
-            break;
-        }
+        ReceiveMidi();
+#if POLYPHONY_GOVERNOR
+        BeepSynthGovern();
+#endif
+#if ISR_PROFILE
+        ProfilerPoll(rxOverrunCount);
+#endif
+#if IDLE_SLEEP
+        IdleWait();
+#endif
     }
 }